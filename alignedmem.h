@@ -0,0 +1,51 @@
+#ifndef ALIGNEDMEM_H
+#define ALIGNEDMEM_H
+
+#include <new>
+#include <stddef.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#define CACHE_LINE_SIZE 64
+
+/* 'size' bytes aligned to 'align', a power of two and a multiple of
+ * sizeof(void *); nullptr if out of memory. Release with aligned_free():
+ * on Windows the block comes from _aligned_malloc(), which free() cannot
+ * take. */
+static inline void *aligned_malloc(size_t size, size_t align)
+{
+	void *p;
+#ifdef _WIN32
+	p = _aligned_malloc(size, align);
+#else
+	if (posix_memalign(&p, align, size) != 0) p = nullptr;
+#endif
+	return p;
+}
+static inline void aligned_free(void *p)
+{
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+/* Base of the objects that hold cache line aligned members (rings) and are
+ * allocated with new, which does not honour over-alignment before C++17. */
+struct CacheAligned {
+	static void *operator new(size_t size)
+	{
+		void *p = aligned_malloc(size, CACHE_LINE_SIZE);
+		if (!p) throw std::bad_alloc();
+		return p;
+	}
+	static void operator delete(void *p)
+	{
+		aligned_free(p);
+	}
+};
+
+#endif
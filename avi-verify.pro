@@ -0,0 +1,10 @@
+
+TARGET = avi-verify
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= qt app_bundle
+
+DESTDIR = $$PWD/_bin
+
+SOURCES += \
+	aviverify.cpp
@@ -0,0 +1,519 @@
+/*
+ * avi-verify: check an AVI written by ffmpeg-encode-avi from its indexes
+ * alone, without decoding anything.
+ *
+ * The file is memory-mapped and its RIFF structure walked directly. The
+ * OpenDML index (indx super index and ix## chunks) is used when present,
+ * idx1 otherwise. Every index entry is checked against the chunk it
+ * points at, then frame counts, keyframes, timing and the interleaving
+ * of the streams are reported.
+ *
+ * AVI has no per-chunk timestamps: a chunk's time is its position in its
+ * stream (times rate/scale, or its byte offset for fixed-size samples).
+ * What can go wrong with timing is therefore checked on the index: audio
+ * chunks holding partial blocks, empty video chunks (the gaps the muxer
+ * fills for missing frames), streams whose durations disagree, and an
+ * avih frame period that does not match the video stream.
+ */
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define MAX_STREAMS      16
+#define AVIIF_KEYFRAME   0x10
+#define AVI_INDEX_OF_INDEXES 0x00
+#define AVI_INDEX_OF_CHUNKS  0x01
+
+struct IndexEntry {
+	uint64_t offset; /* of the chunk header */
+	uint32_t size;
+	bool key;
+};
+
+struct StreamInfo {
+	char type[5] = "";
+	uint32_t scale = 0, rate = 0, start = 0, length = 0, sample_size = 0;
+	uint64_t super_index = 0; /* offset of the indx chunk data, 0 if none */
+	uint32_t super_index_size = 0;
+	std::vector<IndexEntry> chunks;
+};
+
+struct AviFile {
+	const char *name;
+	const uint8_t *data = nullptr;
+	uint64_t size = 0;
+	uint32_t total_frames = 0;  /* avih, first RIFF only */
+	uint32_t usec_per_frame = 0; /* avih */
+	uint32_t odml_frames = 0;   /* dmlh, whole file */
+	int nb_riff = 0;
+	uint64_t movi = 0;          /* 'movi' fourcc of the first RIFF */
+	uint64_t idx1 = 0;          /* idx1 chunk data, 0 if none */
+	uint32_t idx1_size = 0;
+	int nb_streams = 0;
+	StreamInfo streams[MAX_STREAMS];
+	int errors = 0;
+	bool verbose = false;
+};
+
+static uint16_t rd16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+static uint32_t rd32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+static uint64_t rd64(const uint8_t *p)
+{
+	return rd32(p) | (uint64_t)rd32(p + 4) << 32;
+}
+static bool is_tag(const uint8_t *p, const char *tag)
+{
+	return memcmp(p, tag, 4) == 0;
+}
+
+static void error(AviFile *f, const char *fmt, ...)
+{
+	va_list ap;
+	/* the first few are enough to see what is wrong */
+	if (f->errors++ >= 20) return;
+	fprintf(stderr, "%s: error: ", f->name);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+/* Stream number of a chunk id like "01wb", -1 if it is not one. */
+static int chunk_stream(const uint8_t *id)
+{
+	if (id[0] < '0' || id[0] > '9' || id[1] < '0' || id[1] > '9') return -1;
+	return (id[0] - '0') * 10 + (id[1] - '0');
+}
+
+/**************************************************************/
+/* headers */
+
+static void parse_strl(AviFile *f, uint64_t pos, uint64_t end)
+{
+	if (f->nb_streams >= MAX_STREAMS) {
+		error(f, "more than %d streams", MAX_STREAMS);
+		return;
+	}
+	StreamInfo *st = &f->streams[f->nb_streams++];
+	while (pos + 8 <= end) {
+		const uint8_t *p = f->data + pos;
+		uint32_t len = rd32(p + 4);
+		if (pos + 8 + len > end) break;
+		if (is_tag(p, "strh") && len >= 48) {
+			memcpy(st->type, p + 8, 4);
+			st->scale = rd32(p + 8 + 20);
+			st->rate = rd32(p + 8 + 24);
+			st->start = rd32(p + 8 + 28);
+			st->length = rd32(p + 8 + 32);
+			st->sample_size = rd32(p + 8 + 44);
+		} else if (is_tag(p, "indx")) {
+			st->super_index = pos + 8;
+			st->super_index_size = len;
+		}
+		pos += 8 + len + (len & 1);
+	}
+}
+static void parse_hdrl(AviFile *f, uint64_t pos, uint64_t end)
+{
+	while (pos + 8 <= end) {
+		const uint8_t *p = f->data + pos;
+		uint32_t len = rd32(p + 4);
+		if (pos + 8 + len > end) {
+			error(f, "chunk at %llu runs past its list", (unsigned long long)pos);
+			break;
+		}
+		if (is_tag(p, "avih") && len >= 28) {
+			f->usec_per_frame = rd32(p + 8);
+			f->total_frames = rd32(p + 8 + 16);
+		} else if (is_tag(p, "LIST") && len >= 4 && is_tag(p + 8, "strl")) {
+			parse_strl(f, pos + 12, pos + 8 + len);
+		} else if (is_tag(p, "LIST") && len >= 4 && is_tag(p + 8, "odml")) {
+			if (len >= 16 && is_tag(p + 12, "dmlh")) f->odml_frames = rd32(p + 20);
+		}
+		pos += 8 + len + (len & 1);
+	}
+}
+/* Top level: RIFF AVI followed by RIFF AVIX extensions (OpenDML). */
+static void parse_riff(AviFile *f)
+{
+	uint64_t pos = 0;
+	while (pos + 12 <= f->size) {
+		const uint8_t *p = f->data + pos;
+		uint32_t len = rd32(p + 4);
+		if (!is_tag(p, "RIFF") || !(is_tag(p + 8, "AVI ") || is_tag(p + 8, "AVIX"))) {
+			error(f, "no RIFF AVI list at offset %llu", (unsigned long long)pos);
+			return;
+		}
+		uint64_t end = pos + 8 + len;
+		if (end > f->size) {
+			error(f, "RIFF at %llu is %u bytes but the file ends after %llu", (unsigned long long)pos, len, (unsigned long long)(f->size - pos - 8));
+			end = f->size;
+		}
+		bool first = f->nb_riff++ == 0;
+		for (uint64_t q = pos + 12; q + 8 <= end;) {
+			const uint8_t *c = f->data + q;
+			uint32_t clen = rd32(c + 4);
+			if (q + 8 + clen > end) {
+				error(f, "chunk '%.4s' at %llu runs past its RIFF", (const char *)c, (unsigned long long)q);
+				break;
+			}
+			if (first && is_tag(c, "LIST") && clen >= 4 && is_tag(c + 8, "hdrl")) {
+				parse_hdrl(f, q + 12, q + 8 + clen);
+			} else if (first && is_tag(c, "LIST") && clen >= 4 && is_tag(c + 8, "movi")) {
+				f->movi = q + 8;
+			} else if (first && is_tag(c, "idx1")) {
+				f->idx1 = q + 8;
+				f->idx1_size = clen;
+			}
+			q += 8 + clen + (clen & 1);
+		}
+		pos = end + (len & 1);
+	}
+}
+
+/**************************************************************/
+/* indexes */
+
+/* Check that a data chunk of stream 'n' with 'size' bytes starts at 'offset'. */
+static bool check_chunk(AviFile *f, int n, uint64_t offset, uint32_t size)
+{
+	if (offset > f->size || f->size - offset < 8 + (uint64_t)size) {
+		error(f, "stream %d: chunk at %llu (%u bytes) is past the end of the file", n, (unsigned long long)offset, size);
+		return false;
+	}
+	const uint8_t *p = f->data + offset;
+	if (chunk_stream(p) != n) {
+		error(f, "stream %d: index points at '%.4s' at %llu", n, (const char *)p, (unsigned long long)offset);
+		return false;
+	}
+	if (rd32(p + 4) != size) {
+		error(f, "stream %d: chunk at %llu is %u bytes, index says %u", n, (unsigned long long)offset, rd32(p + 4), size);
+		return false;
+	}
+	return true;
+}
+static void read_odml_index(AviFile *f, int n)
+{
+	StreamInfo *st = &f->streams[n];
+	const uint8_t *p = f->data + st->super_index;
+	if (st->super_index_size < 24 || p[3] != AVI_INDEX_OF_INDEXES || rd16(p) != 4) {
+		error(f, "stream %d: unsupported indx", n);
+		return;
+	}
+	uint32_t entries = rd32(p + 4);
+	if (24 + (uint64_t)entries * 16 > st->super_index_size) {
+		error(f, "stream %d: indx holds %u entries, room for %u", n, entries, (st->super_index_size - 24) / 16);
+		return;
+	}
+	for (uint32_t i = 0; i < entries; i++) {
+		const uint8_t *e = p + 24 + i * 16;
+		uint64_t ix = rd64(e);
+		uint32_t ix_size = rd32(e + 8);
+		if (ix > f->size || f->size - ix < 8 + 24 || ix_size < 8 + 24 || f->size - ix < ix_size) {
+			error(f, "stream %d: standard index %u at %llu is outside the file", n, i, (unsigned long long)ix);
+			continue;
+		}
+		const uint8_t *q = f->data + ix;
+		if (memcmp(q, "ix", 2) != 0 || chunk_stream(q + 2) != n || q[8 + 3] != AVI_INDEX_OF_CHUNKS || rd16(q + 8) != 2) {
+			error(f, "stream %d: no standard index at %llu", n, (unsigned long long)ix);
+			continue;
+		}
+		uint32_t nb = rd32(q + 8 + 4);
+		uint64_t base = rd64(q + 8 + 12);
+		/* the chunk's own size is read from the file too: the entries
+		 * must also fit in the super index's size and in the file */
+		uint64_t room = std::min<uint64_t>(rd32(q + 4), std::min<uint64_t>(ix_size - 8, f->size - ix - 8));
+		uint32_t fit = room < 24 ? 0 : (uint32_t)((room - 24) / 8);
+		if (nb > fit) {
+			error(f, "stream %d: index at %llu holds %u entries, room for %u", n, (unsigned long long)ix, nb, fit);
+			nb = fit;
+		}
+		for (uint32_t k = 0; k < nb; k++) {
+			const uint8_t *c = q + 8 + 24 + k * 8;
+			uint32_t size = rd32(c + 4);
+			/* the entries point at the data, after the chunk header */
+			if (base > f->size || rd32(c) > f->size - base || base + rd32(c) < 8) {
+				error(f, "stream %d: index at %llu entry %u points outside the file", n, (unsigned long long)ix, k);
+				continue;
+			}
+			IndexEntry entry;
+			entry.offset = base + rd32(c) - 8;
+			entry.size = size & 0x7fffffff;
+			entry.key = !(size & 0x80000000);
+			st->chunks.push_back(entry);
+		}
+	}
+}
+/* idx1 offsets are relative to the 'movi' fourcc, or absolute in some
+ * writers; the first entry tells which. */
+static void read_idx1(AviFile *f, std::vector<IndexEntry> *out)
+{
+	const uint8_t *p = f->data + f->idx1;
+	uint32_t entries = f->idx1_size / 16;
+	uint64_t base = f->movi;
+	for (uint32_t i = 0; i < entries; i++) {
+		const uint8_t *e = p + i * 16;
+		int n = chunk_stream(e);
+		if (n < 0) continue;
+		if (i == 0 && f->movi + rd32(e + 8) + 4 <= f->size && !is_tag(f->data + f->movi + rd32(e + 8), (const char *)e)) {
+			base = 0;
+		}
+		if (n >= f->nb_streams) {
+			error(f, "idx1 entry %u refers to stream %d", i, n);
+			continue;
+		}
+		IndexEntry entry;
+		entry.offset = base + rd32(e + 8);
+		entry.size = rd32(e + 12);
+		entry.key = (rd32(e + 4) & AVIIF_KEYFRAME) != 0;
+		out[n].push_back(entry);
+	}
+}
+
+/**************************************************************/
+/* report */
+
+static double chunk_time(const StreamInfo *st, uint64_t index, uint64_t bytes)
+{
+	if (!st->rate) return 0;
+	uint64_t units = st->sample_size ? bytes / st->sample_size : index;
+	return (double)(st->start + units) * st->scale / st->rate;
+}
+
+struct Placed {
+	uint64_t offset;
+	int stream;
+	double time;
+};
+
+static void verify(AviFile *f)
+{
+	parse_riff(f);
+	if (!f->nb_riff) return;
+	if (!f->movi) error(f, "no movi list");
+	bool odml = false;
+	for (int n = 0; n < f->nb_streams; n++) {
+		if (f->streams[n].super_index) odml = true;
+	}
+	std::vector<IndexEntry> idx1[MAX_STREAMS];
+	if (f->idx1) read_idx1(f, idx1);
+	for (int n = 0; n < f->nb_streams; n++) {
+		StreamInfo *st = &f->streams[n];
+		if (odml) {
+			if (st->super_index) read_odml_index(f, n);
+			else error(f, "stream %d has no indx", n);
+			/* idx1 covers the first RIFF and must agree with it */
+			size_t common = std::min(idx1[n].size(), st->chunks.size());
+			for (size_t i = 0; i < common; i++) {
+				if (idx1[n][i].offset != st->chunks[i].offset || idx1[n][i].size != st->chunks[i].size || idx1[n][i].key != st->chunks[i].key) {
+					error(f, "stream %d: idx1 and OpenDML index differ at chunk %zu", n, i);
+					break;
+				}
+			}
+			if (idx1[n].size() > st->chunks.size()) error(f, "stream %d: idx1 has more chunks than the OpenDML index", n);
+		} else {
+			st->chunks.swap(idx1[n]);
+		}
+	}
+	printf("%s: %llu bytes, %d RIFF, %s index\n", f->name, (unsigned long long)f->size, f->nb_riff, odml ? "OpenDML" : f->idx1 ? "idx1" : "no");
+
+	std::vector<Placed> placed;
+	int video = -1;
+	uint64_t video_frames = 0;
+	double end_time[MAX_STREAMS] = {}, max_span[MAX_STREAMS] = {};
+	for (int n = 0; n < f->nb_streams; n++) {
+		StreamInfo *st = &f->streams[n];
+		bool vids = is_tag((const uint8_t *)st->type, "vids");
+		uint64_t bytes = 0, prev = 0;
+		uint64_t keys = 0, gop = 0, max_gop = 0;
+		uint64_t empty = 0, run = 0, max_run = 0;
+		uint64_t partial = 0; /* reported once */
+		for (size_t i = 0; i < st->chunks.size(); i++) {
+			const IndexEntry *e = &st->chunks[i];
+			check_chunk(f, n, e->offset, e->size);
+			if (i && e->offset <= prev) error(f, "stream %d: chunk %zu is not after chunk %zu", n, i, i - 1);
+			prev = e->offset;
+			if (st->sample_size && e->size % st->sample_size && !partial++) {
+				error(f, "stream %d: chunk %zu holds %u bytes, not whole %u byte blocks", n, i, e->size, st->sample_size);
+			}
+			if (vids && e->size == 0) {
+				empty++;
+				max_run = std::max(max_run, ++run);
+			} else {
+				run = 0;
+			}
+			Placed pl = { e->offset, n, chunk_time(st, i, bytes) };
+			placed.push_back(pl);
+			bytes += e->size;
+			max_span[n] = std::max(max_span[n], chunk_time(st, i + 1, bytes) - pl.time);
+			if (e->key) {
+				if (f->verbose && vids) printf("  stream %d key frame %zu at %llu, %.3f s\n", n, i, (unsigned long long)e->offset, pl.time);
+				keys++;
+				gop = 0;
+			}
+			max_gop = std::max(max_gop, ++gop);
+		}
+		uint64_t units = st->sample_size ? bytes / st->sample_size : st->chunks.size();
+		end_time[n] = chunk_time(st, st->chunks.size(), bytes);
+		double duration = end_time[n] - chunk_time(st, 0, 0);
+		if (vids) {
+			if (video < 0) {
+				video = n;
+				video_frames = st->chunks.size();
+			}
+			printf("  stream %d vids: %zu frames, %llu key (longest GOP %llu), %.3f s\n", n, st->chunks.size(), (unsigned long long)keys, (unsigned long long)max_gop, duration);
+			if (!st->chunks.empty() && !st->chunks[0].key) error(f, "stream %d: first frame is not a key frame", n);
+			if (empty) printf("  stream %d: %llu empty frames (gaps), longest run %llu\n", n, (unsigned long long)empty, (unsigned long long)max_run);
+		} else {
+			printf("  stream %d %s: %zu chunks, %llu %s, %.3f s\n", n, st->type, st->chunks.size(), (unsigned long long)units, st->sample_size ? "samples" : "packets", duration);
+		}
+		if (units != st->length) error(f, "stream %d: header length %u, index holds %llu", n, st->length, (unsigned long long)units);
+	}
+	if (video >= 0) {
+		if (odml && f->odml_frames != video_frames) error(f, "dmlh says %u frames, index holds %llu", f->odml_frames, (unsigned long long)video_frames);
+		if (f->total_frames > video_frames) error(f, "avih says %u frames, index holds %llu", f->total_frames, (unsigned long long)video_frames);
+		const StreamInfo *st = &f->streams[video];
+		if (f->usec_per_frame && st->rate) {
+			double period = 1e6 * st->scale / st->rate;
+			if (fabs(f->usec_per_frame - period) > 1) error(f, "avih frame period %u us, stream %d has %.1f us", f->usec_per_frame, video, period);
+		}
+	}
+	/* The streams must end together, give or take their largest chunk. */
+	int ref = video >= 0 ? video : 0;
+	for (int n = 0; n < f->nb_streams; n++) {
+		if (n == ref || f->streams[n].chunks.empty() || f->streams[ref].chunks.empty()) continue;
+		if (fabs(end_time[n] - end_time[ref]) > max_span[n] + max_span[ref]) {
+			error(f, "stream %d ends at %.3f s, stream %d at %.3f s", n, end_time[n], ref, end_time[ref]);
+		}
+	}
+
+	/* Interleave: walking the file in order, how far apart in time the
+	 * most recent chunks of the streams are. A player reading
+	 * sequentially has to buffer that much. */
+	std::sort(placed.begin(), placed.end(), [](const Placed &a, const Placed &b) { return a.offset < b.offset; });
+	double last[MAX_STREAMS];
+	bool seen[MAX_STREAMS] = {};
+	double max_dist = 0, sum_dist = 0;
+	uint64_t max_at = 0, nb_dist = 0;
+	for (size_t i = 0; i < placed.size(); i++) {
+		last[placed[i].stream] = placed[i].time;
+		seen[placed[i].stream] = true;
+		double lo = 1e300, hi = -1e300;
+		int nb_seen = 0;
+		for (int n = 0; n < f->nb_streams; n++) {
+			if (!seen[n]) continue;
+			lo = std::min(lo, last[n]);
+			hi = std::max(hi, last[n]);
+			nb_seen++;
+		}
+		if (nb_seen < 2) continue;
+		sum_dist += hi - lo;
+		nb_dist++;
+		if (hi - lo > max_dist) {
+			max_dist = hi - lo;
+			max_at = placed[i].offset;
+		}
+	}
+	if (nb_dist) {
+		printf("  interleave: max distance %.3f s at offset %llu, mean %.3f s\n", max_dist, (unsigned long long)max_at, sum_dist / nb_dist);
+	}
+}
+
+/**************************************************************/
+
+static bool map_file(AviFile *f)
+{
+#ifdef _WIN32
+	FILE *fp = fopen(f->name, "rb");
+	if (!fp) return false;
+	_fseeki64(fp, 0, SEEK_END);
+	f->size = _ftelli64(fp);
+	_fseeki64(fp, 0, SEEK_SET);
+	uint8_t *buf = (uint8_t *)malloc(f->size ? f->size : 1);
+	bool ok = buf && fread(buf, 1, f->size, fp) == f->size;
+	fclose(fp);
+	if (!ok) {
+		free(buf);
+		return false;
+	}
+	f->data = buf;
+	return true;
+#else
+	int fd = open(f->name, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat sb;
+	if (fstat(fd, &sb) != 0 || sb.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	void *p = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) return false;
+	f->data = (const uint8_t *)p;
+	f->size = sb.st_size;
+	return true;
+#endif
+}
+static void unmap_file(AviFile *f)
+{
+#ifdef _WIN32
+	free((void *)f->data);
+#else
+	munmap((void *)f->data, f->size);
+#endif
+}
+
+int main(int argc, char **argv)
+{
+	bool verbose = false;
+	int failed = 0, files = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-v") == 0) {
+			verbose = true;
+			continue;
+		}
+		if (argv[i][0] == '-') {
+			fprintf(stderr, "usage: %s [-v] FILE.avi...\n  -v  list the key frames\n", argv[0]);
+			return 2;
+		}
+		AviFile f;
+		f.name = argv[i];
+		f.verbose = verbose;
+		files++;
+		if (!map_file(&f)) {
+			fprintf(stderr, "%s: could not read the file\n", f.name);
+			failed++;
+			continue;
+		}
+		auto t0 = std::chrono::steady_clock::now();
+		verify(&f);
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+		printf("  %s in %.2f ms\n", f.errors ? "FAILED" : "OK", ms);
+		if (f.errors) failed++;
+		unmap_file(&f);
+	}
+	if (!files) {
+		fprintf(stderr, "usage: %s [-v] FILE.avi...\n", argv[0]);
+		return 2;
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,70 @@
+#include "bench.h"
+#include <atomic>
+#include <chrono>
+#include <time.h>
+
+bool bench_enabled = false;
+
+static const char *stage_names[BENCH_STAGE_COUNT] = {
+	"video generate",
+	"video convert",
+	"video gen+conv",
+	"video encode",
+	"audio generate",
+	"audio resample",
+	"audio encode",
+	"mux",
+};
+static std::atomic<uint64_t> stage_ns[BENCH_STAGE_COUNT];
+static std::atomic<uint64_t> stage_calls[BENCH_STAGE_COUNT];
+static std::chrono::steady_clock::time_point wall_start;
+
+/* CPU time of the calling thread in nanoseconds, so that a stage is not
+ * charged for time the thread spent descheduled. */
+uint64_t bench_clock()
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+const char *bench_stage_name(int stage)
+{
+	return stage < BENCH_STAGE_COUNT ? stage_names[stage] : "other";
+}
+
+void bench_start()
+{
+	for (int i = 0; i < BENCH_STAGE_COUNT; i++) {
+		stage_ns[i] = 0;
+		stage_calls[i] = 0;
+	}
+	wall_start = std::chrono::steady_clock::now();
+}
+
+void bench_add(BenchStage stage, uint64_t ns, int calls)
+{
+	stage_ns[stage].fetch_add(ns, std::memory_order_relaxed);
+	stage_calls[stage].fetch_add(calls, std::memory_order_relaxed);
+}
+
+void bench_report(FILE *fp, int frames, double media_seconds)
+{
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+	uint64_t total = 0;
+	for (int i = 0; i < BENCH_STAGE_COUNT; i++) {
+		total += stage_ns[i];
+	}
+	fprintf(fp, "%-16s %8s %10s %10s %6s\n", "stage", "calls", "cpu ms", "us/call", "share");
+	for (int i = 0; i < BENCH_STAGE_COUNT; i++) {
+		uint64_t ns = stage_ns[i];
+		uint64_t calls = stage_calls[i];
+		if (!calls) continue;
+		fprintf(fp, "%-16s %8llu %10.2f %10.2f %5.1f%%\n", stage_names[i], (unsigned long long)calls, ns / 1e6, ns / 1e3 / calls, total ? ns * 100.0 / total : 0.0);
+	}
+	fprintf(fp, "wall %.3f s, %d frames, %.1f fps, %.2fx realtime\n", wall, frames, wall > 0 ? frames / wall : 0.0, wall > 0 ? media_seconds / wall : 0.0);
+}
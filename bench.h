@@ -0,0 +1,60 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "memprof.h"
+#include "perfcount.h"
+
+/* Per-stage CPU time accounting for the encode loop. When disabled,
+ * bench_begin() returns 0 and bench_end() is a no-op, so the calls can
+ * stay in the hot path. The same brackets tell the heap profiler which
+ * stage an allocation belongs to, and delimit the hardware counter
+ * readings of -perf. */
+enum BenchStage {
+	BENCH_VIDEO_GENERATE,
+	BENCH_VIDEO_CONVERT,
+	BENCH_VIDEO_FUSED, /* generate and convert in one kernel */
+	BENCH_VIDEO_ENCODE,
+	BENCH_AUDIO_GENERATE,
+	BENCH_AUDIO_RESAMPLE,
+	BENCH_AUDIO_ENCODE,
+	BENCH_MUX,
+	BENCH_STAGE_COUNT
+};
+
+extern bool bench_enabled;
+
+uint64_t bench_clock();
+void bench_start();
+void bench_add(BenchStage stage, uint64_t ns, int calls);
+void bench_report(FILE *fp, int frames, double media_seconds);
+const char *bench_stage_name(int stage);
+
+static inline uint64_t bench_begin(BenchStage stage)
+{
+	if (memprof_enabled) memprof_stage = stage;
+	if (perfcount_enabled) perfcount_begin();
+	return bench_enabled ? bench_clock() : 0;
+}
+static inline void bench_end(BenchStage stage, uint64_t start)
+{
+	if (memprof_enabled) memprof_stage = BENCH_STAGE_COUNT;
+	if (perfcount_enabled) perfcount_end(stage, 1);
+	if (bench_enabled) bench_add(stage, bench_clock() - start, 1);
+}
+/* Work another thread does for a stage that is still in progress (the
+ * slice pool's jobs for a video encoder): its time and counters go to the
+ * stage, but it is not another call. */
+static inline uint64_t bench_help_begin(BenchStage stage)
+{
+	return bench_begin(stage);
+}
+static inline void bench_help_end(BenchStage stage, uint64_t start)
+{
+	if (memprof_enabled) memprof_stage = BENCH_STAGE_COUNT;
+	if (perfcount_enabled) perfcount_end(stage, 0);
+	if (bench_enabled) bench_add(stage, bench_clock() - start, 0);
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+
+/* Bytes held by one kind of buffer (pictures, encoded packets) against a
+ * limit, 0 meaning no limit and only the accounting. A producer thread
+ * acquire()s before it allocates and sleeps while the charge would go
+ * over the limit; the consumer thread release()s what it is done with.
+ * acquire() lets a charge through anyway when it could otherwise wait
+ * forever: once nothing else is held (a charge larger than the whole
+ * limit), and while the consumer is idle, waiting for the producers,
+ * as when the encoder holds on to frames until it is given more.
+ * force() charges without waiting, for memory that is already allocated
+ * or cannot be refused. The peak is kept for the report. */
+class ByteBudget {
+private:
+	std::mutex lock_;
+	std::condition_variable released_;
+	int64_t limit_;
+	int64_t used_ = 0;
+	int64_t peak_ = 0;
+	bool closed_ = false;
+	bool consumer_idle_ = false;
+
+	void charge(int64_t n)
+	{
+		used_ += n;
+		if (used_ > peak_) peak_ = used_;
+	}
+public:
+	explicit ByteBudget(int64_t limit)
+		: limit_(limit)
+	{
+	}
+	ByteBudget(ByteBudget const &) = delete;
+	ByteBudget &operator = (ByteBudget const &) = delete;
+
+	/* Charge n bytes, sleeping until they fit. Fails once closed. */
+	bool acquire(int64_t n)
+	{
+		std::unique_lock<std::mutex> lock(lock_);
+		while (limit_ && used_ > 0 && used_ + n > limit_ && !consumer_idle_ && !closed_) {
+			released_.wait(lock);
+		}
+		if (closed_) return false;
+		charge(n);
+		return true;
+	}
+	void force(int64_t n)
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		charge(n);
+	}
+	void release(int64_t n)
+	{
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			used_ -= n;
+		}
+		released_.notify_all();
+	}
+	/* The consumer has nothing left to take and waits for the producers,
+	 * so nothing will be released before they go on. */
+	void set_consumer_idle(bool idle)
+	{
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			consumer_idle_ = idle;
+		}
+		if (idle) released_.notify_all();
+	}
+	/* Wake the waiters; acquire fails from now on. */
+	void close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			closed_ = true;
+		}
+		released_.notify_all();
+	}
+	bool closed()
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		return closed_;
+	}
+	/* At the limit with the consumer still busy: the consumer is behind,
+	 * rather than the limit being taken up by what it holds while idle. */
+	bool full()
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		return limit_ && used_ >= limit_ && !consumer_idle_;
+	}
+	int64_t used()
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		return used_;
+	}
+	int64_t peak()
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		return peak_;
+	}
+	int64_t limit() const
+	{
+		return limit_;
+	}
+};
+
+#endif
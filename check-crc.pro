@@ -0,0 +1,18 @@
+TARGET = check-crc
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= qt app_bundle
+
+DESTDIR = $$PWD/_bin
+
+unix:LIBS += -lpthread
+
+SOURCES += \
+	checkcrc.cpp \
+	cpu.cpp \
+	crc32c.cpp
+
+HEADERS += \
+	check.h \
+	cpu.h \
+	crc32c.h
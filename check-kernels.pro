@@ -0,0 +1,19 @@
+TARGET = check-kernels
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= qt app_bundle
+
+DESTDIR = $$PWD/_bin
+
+unix:LIBS += -lpthread
+
+SOURCES += \
+	checkkernels.cpp \
+	cpu.cpp \
+	kernels.cpp
+
+HEADERS += \
+	alignedmem.h \
+	check.h \
+	cpu.h \
+	kernels.h
@@ -0,0 +1,16 @@
+TARGET = check-ring
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= qt app_bundle
+
+DESTDIR = $$PWD/_bin
+
+unix:LIBS += -lpthread
+
+SOURCES += \
+	checkring.cpp
+
+HEADERS += \
+	alignedmem.h \
+	check.h \
+	ringbuffer.h
@@ -0,0 +1,38 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+/* Shared by the standalone check programs (make check). Each is a single
+ * translation unit, so the counters live here. CHECK() counts a check and
+ * reports it with its source line if it fails; CHECKF() reports a failure
+ * with a message of its own. check_report() prints the summary line and
+ * returns the exit status. */
+static int check_count, check_failures;
+
+#define CHECK(cond) do { \
+	check_count++; \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		check_failures++; \
+	} \
+} while (0)
+
+#define CHECKF(cond, ...) do { \
+	check_count++; \
+	if (!(cond)) { \
+		fprintf(stderr, __VA_ARGS__); \
+		fputc('\n', stderr); \
+		check_failures++; \
+	} \
+} while (0)
+
+/* "name: OK, N checks, 0 failed[, detail]" */
+static inline int check_report(const char *name, const char *detail)
+{
+	printf("%s: %s, %d checks, %d failed%s%s\n", name, check_failures ? "FAILED" : "OK",
+		check_count, check_failures, detail ? ", " : "", detail ? detail : "");
+	return check_failures ? 1 : 0;
+}
+
+#endif
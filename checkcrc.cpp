@@ -0,0 +1,75 @@
+/*
+ * check-crc: crc32c() against the check value and a bit-at-a-time
+ * reference over lengths and alignments that cover the head, body and tail
+ * of the word loop, and crc32c_combine() against the CRC of the
+ * concatenation.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "check.h"
+#include "cpu.h"
+#include "crc32c.h"
+
+static uint32_t crc32c_bitwise(uint32_t crc, const uint8_t *p, size_t len)
+{
+	crc = ~crc;
+	while (len--) {
+		crc ^= *p++;
+		for (int k = 0; k < 8; k++) {
+			crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+		}
+	}
+	return ~crc;
+}
+
+int main()
+{
+	static uint8_t buf[4096 + 16];
+	uint32_t x = 1;
+	for (size_t i = 0; i < sizeof(buf); i++) {
+		x = x * 1664525 + 1013904223;
+		buf[i] = (uint8_t)(x >> 24);
+	}
+
+	CHECK(crc32c(0, "", 0) == 0);
+	CHECK(crc32c(0, "123456789", 9) == 0xe3069283);
+	static const uint8_t zeros[32] = { 0 };
+	CHECK(crc32c(0, zeros, 32) == 0x8a9136aa);
+
+	/* every start offset within a word, lengths around the word size */
+	int mismatches = 0;
+	for (size_t off = 0; off < 16; off++) {
+		for (size_t len = 0; len <= 70; len++) {
+			if (crc32c(0, buf + off, len) != crc32c_bitwise(0, buf + off, len)) mismatches++;
+		}
+		if (crc32c(0, buf + off, 4096) != crc32c_bitwise(0, buf + off, 4096)) mismatches++;
+	}
+	CHECK(mismatches == 0);
+
+	/* continuing from a CRC equals one pass over the whole */
+	uint32_t whole = crc32c(0, buf, 4096);
+	for (size_t split = 0; split <= 4096; split += 97) {
+		CHECK(crc32c(crc32c(0, buf, split), buf + split, 4096 - split) == whole);
+	}
+
+	/* combine, including an empty second part */
+	for (size_t split = 0; split <= 4096; split += 97) {
+		uint32_t a = crc32c(0, buf, split);
+		uint32_t b = crc32c(0, buf + split, 4096 - split);
+		CHECK(crc32c_combine(a, b, 4096 - split) == whole);
+	}
+	CHECK(crc32c_combine(whole, 0, 0) == whole);
+	/* blocks of the manifest's size, as the whole-file CRC is built */
+	static uint8_t big[3 << 20];
+	for (size_t i = 0; i < sizeof(big); i++) {
+		big[i] = buf[i % 4093];
+	}
+	uint32_t combined = 0;
+	for (size_t b = 0; b < 3; b++) {
+		combined = crc32c_combine(combined, crc32c(0, big + (b << 20), 1 << 20), 1 << 20);
+	}
+	CHECK(combined == crc32c(0, big, sizeof(big)));
+
+	return check_report("check-crc", cpu_has_crc32c() ? "sse4.2" : "table");
+}
@@ -0,0 +1,201 @@
+/*
+ * check-kernels: run every kernel at every instruction set level this CPU
+ * supports and compare the output byte for byte with the scalar code, for
+ * the specialized widths and for generic widths with a tail, and audio
+ * runs of every length around the block sizes.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "alignedmem.h"
+#include "check.h"
+#include "cpu.h"
+#include "kernels.h"
+
+#define ROWS 5     /* odd, so that the last pair repeats a row */
+#define PLANE_STRIDE(w) (2 * (w) + 256) /* 16-bit samples, plus slack */
+#define FILL 0xa5  /* bytes a kernel must not touch keep this */
+
+static const int widths[] = { 1280, 1920, 3840, 7680, 64, 66, 130, 718 };
+static const int frames[] = { 0, 1, 63, 100 };
+static const char *pix_fmt_names[KPIX_COUNT] = { "yuv420p", "nv12", "yuv422p", "yuv444p", "yuv420p10", "p010" };
+
+/* Rows of every plane of the output picture, with guard bytes after each
+ * row kept at FILL. */
+struct Picture {
+	uint8_t *rows[3][ROWS];
+};
+
+static uint8_t *alloc_row(size_t size)
+{
+	void *p = aligned_malloc(size, 64);
+	if (!p) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	memset(p, FILL, size);
+	return (uint8_t *)p;
+}
+static void alloc_picture(Picture *pic, int width)
+{
+	for (int p = 0; p < 3; p++) {
+		for (int y = 0; y < ROWS; y++) {
+			pic->rows[p][y] = alloc_row(PLANE_STRIDE(width));
+		}
+	}
+}
+static void clear_picture(Picture *pic, int width)
+{
+	for (int p = 0; p < 3; p++) {
+		for (int y = 0; y < ROWS; y++) {
+			memset(pic->rows[p][y], FILL, PLANE_STRIDE(width));
+		}
+	}
+}
+static void free_picture(Picture *pic)
+{
+	for (int p = 0; p < 3; p++) {
+		for (int y = 0; y < ROWS; y++) {
+			aligned_free(pic->rows[p][y]);
+		}
+	}
+}
+/* Rows y and y1 of the picture as the kernels take them. */
+static void row_pointers(Picture *pic, int y, int y1, uint8_t **d0, uint8_t **d1)
+{
+	for (int p = 0; p < 3; p++) {
+		d0[p] = pic->rows[p][y];
+		d1[p] = pic->rows[p][y1];
+	}
+}
+static void convert(const Kernels *k, KernelPixFmt fmt, uint8_t *const *rgb, Picture *pic, int width)
+{
+	for (int y = 0; y < ROWS; y += 2) {
+		int y1 = y + 1 < ROWS ? y + 1 : y;
+		uint8_t *d0[3], *d1[3];
+		row_pointers(pic, y, y1, d0, d1);
+		k->to_yuv[fmt](rgb[y], rgb[y1], d0, d1, width);
+	}
+}
+static void fused(const Kernels *k, const PatternLut *lut, int frame, Picture *pic)
+{
+	for (int y = 0; y < ROWS; y += 2) {
+		int y1 = y + 1 < ROWS ? y + 1 : y;
+		uint8_t *d0[3], *d1[3];
+		row_pointers(pic, y, y1, d0, d1);
+		k->pattern_yuv420p(lut, y, frame, d0, d1);
+	}
+}
+/* Audio runs: lengths around the block sizes of every level, and a
+ * frame; phases near the wrap and the growth of a high sample rate. */
+static const int audio_lengths[] = { 0, 1, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 1152, 1037 };
+static const uint64_t audio_starts[][3] = {
+	{ 0, 0x0000002636e6f4b5ull, 0x0000000008ba2e8cull },
+	{ 0xfffffffffff00000ull, 0x0123456789abcdefull, 0x00000000deadbeefull },
+	{ 0x8000000000000000ull, 0xfedcba9876543210ull, 0x0000123456789abcull },
+};
+#define AUDIO_MAX 1152
+
+static bool same_picture(const Picture *a, const Picture *b, int width)
+{
+	for (int p = 0; p < 3; p++) {
+		for (int y = 0; y < ROWS; y++) {
+			if (memcmp(a->rows[p][y], b->rows[p][y], PLANE_STRIDE(width)) != 0) return false;
+		}
+	}
+	return true;
+}
+
+int main()
+{
+	CpuLevel max = cpu_detect();
+	Kernels tables[CPU_LEVEL_COUNT][sizeof(widths) / sizeof(widths[0])];
+	for (int level = CPU_SCALAR; level <= max; level++) {
+		kernels_init((CpuLevel)level);
+		for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+			tables[level][w] = *kernels_get(widths[w]);
+		}
+	}
+	for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+		int width = widths[w];
+		const PatternLut *lut = pattern_lut_get(width, ROWS);
+		if (!lut) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+		const Kernels *ref = &tables[CPU_SCALAR][w];
+		uint8_t *ref_rgb[ROWS], *rgb[ROWS];
+		for (int y = 0; y < ROWS; y++) {
+			ref_rgb[y] = alloc_row(3 * width + 64);
+			rgb[y] = alloc_row(3 * width + 64);
+		}
+		Picture ref_pic, pic;
+		alloc_picture(&ref_pic, width);
+		alloc_picture(&pic, width);
+		for (size_t f = 0; f < sizeof(frames) / sizeof(frames[0]); f++) {
+			int frame = frames[f];
+			for (int y = 0; y < ROWS; y++) {
+				ref->pattern_row(ref_rgb[y], lut, y, frame);
+			}
+			for (int level = CPU_SCALAR; level <= max; level++) {
+				const Kernels *k = &tables[level][w];
+				const char *name = cpu_level_name((CpuLevel)level);
+				/* pattern rows */
+				bool ok = true;
+				for (int y = 0; y < ROWS; y++) {
+					memset(rgb[y], FILL, 3 * width + 64);
+					k->pattern_row(rgb[y], lut, y, frame);
+					if (memcmp(rgb[y], ref_rgb[y], 3 * width + 64) != 0) ok = false;
+				}
+				CHECKF(ok, "pattern_row %s width %d frame %d: differs from scalar", name, width, frame);
+				/* conversions, from the same RGB rows */
+				for (int fmt = 0; fmt < KPIX_COUNT; fmt++) {
+					clear_picture(&ref_pic, width);
+					clear_picture(&pic, width);
+					convert(ref, (KernelPixFmt)fmt, ref_rgb, &ref_pic, width);
+					convert(k, (KernelPixFmt)fmt, ref_rgb, &pic, width);
+					CHECKF(same_picture(&pic, &ref_pic, width), "to_yuv %s %s width %d frame %d: differs from scalar", pix_fmt_names[fmt], name, width, frame);
+				}
+				/* fused, against pattern_row + to_yuv of the scalar code */
+				clear_picture(&ref_pic, width);
+				clear_picture(&pic, width);
+				convert(ref, KPIX_YUV420P, ref_rgb, &ref_pic, width);
+				fused(k, lut, frame, &pic);
+				CHECKF(same_picture(&pic, &ref_pic, width), "pattern_yuv420p %s width %d frame %d: differs from scalar", name, width, frame);
+			}
+		}
+		for (int y = 0; y < ROWS; y++) {
+			aligned_free(ref_rgb[y]);
+			aligned_free(rgb[y]);
+		}
+		free_picture(&ref_pic);
+		free_picture(&pic);
+	}
+	/* audio, against the scalar code and against sin() */
+	int16_t ref_audio[AUDIO_MAX + 1], audio[AUDIO_MAX + 1];
+	for (size_t a = 0; a < sizeof(audio_starts) / sizeof(audio_starts[0]); a++) {
+		const uint64_t *st = audio_starts[a];
+		for (size_t l = 0; l < sizeof(audio_lengths) / sizeof(audio_lengths[0]); l++) {
+			int n = audio_lengths[l];
+			ref_audio[n] = audio[n] = 0x5a5a; /* past the end, untouched */
+			tables[CPU_SCALAR][0].audio_synth(ref_audio, n, st[0], st[1], st[2]);
+			uint64_t phase = st[0], incr = st[1];
+			bool close = true;
+			for (int j = 0; j < n; j++) {
+				int v = (int)(sin(2 * M_PI * (double)(phase >> 32) / 4294967296.0) * 10000);
+				if (abs(ref_audio[j] - v) > 1) close = false;
+				audio_synth_advance(&phase, &incr, st[2], 1);
+			}
+			CHECKF(close && ref_audio[n] == 0x5a5a, "audio_synth scalar run %zu length %d: not sin() to within 1", a, n);
+			for (int level = CPU_SSE41; level <= max; level++) {
+				tables[level][0].audio_synth(audio, n, st[0], st[1], st[2]);
+				CHECKF(memcmp(audio, ref_audio, (n + 1) * sizeof(int16_t)) == 0, "audio_synth %s run %zu length %d: differs from scalar", cpu_level_name((CpuLevel)level), a, n);
+			}
+		}
+	}
+	char levels[64];
+	snprintf(levels, sizeof(levels), "levels up to %s", cpu_level_name(max));
+	return check_report("check-kernels", levels);
+}
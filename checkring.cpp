@@ -0,0 +1,202 @@
+/*
+ * check-ring: SpscRing order, capacity, wrap-around, batches and close()
+ * semantics, single-threaded and with a producer and a consumer thread.
+ */
+
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+#include "check.h"
+#include "ringbuffer.h"
+
+typedef SpscRing<int, 4> Ring;
+
+static void check_single_thread()
+{
+	Ring *r = new Ring;
+	int v;
+	CHECK(!r->try_pop(&v));
+	for (int i = 0; i < 4; i++) {
+		CHECK(r->try_push(i));
+	}
+	CHECK(!r->try_push(4)); /* full */
+	for (int i = 0; i < 4; i++) {
+		CHECK(r->try_pop(&v) && v == i);
+	}
+	CHECK(!r->try_pop(&v));
+	/* the indices wrap many times around the slots */
+	int next_in = 0, next_out = 0;
+	for (int round = 0; round < 1000; round++) {
+		int n = round % 4 + 1;
+		for (int i = 0; i < n; i++) {
+			CHECK(r->try_push(next_in++));
+		}
+		for (int i = 0; i < n; i++) {
+			CHECK(r->try_pop(&v) && v == next_out++);
+		}
+	}
+	/* close: what is queued still comes out, then pop fails */
+	CHECK(r->push(1) && r->push(2));
+	r->close();
+	CHECK(!r->push(3));
+	CHECK(r->pop(&v) && v == 1);
+	CHECK(r->pop(&v) && v == 2);
+	CHECK(!r->pop(&v));
+	delete r;
+}
+
+/* Batches: partial when the ring is full or short, in order across the
+ * wrap, and mixed with single items. */
+static void check_batches()
+{
+	Ring *r = new Ring;
+	int in[6] = { 0, 1, 2, 3, 4, 5 }, out[6];
+	CHECK(r->try_pop_n(out, 6) == 0);
+	CHECK(r->try_push_n(in, 3) == 3);
+	CHECK(r->try_push_n(in + 3, 3) == 1); /* room for one */
+	CHECK(r->try_push_n(in + 4, 2) == 0);
+	CHECK(r->try_pop_n(out, 2) == 2 && out[0] == 0 && out[1] == 1);
+	CHECK(r->try_push_n(in + 4, 2) == 2); /* across the wrap */
+	CHECK(r->try_pop_n(out, 6) == 4);
+	CHECK(out[0] == 2 && out[1] == 3 && out[2] == 4 && out[3] == 5);
+	CHECK(r->push_n(in, 2) == 2);
+	CHECK(r->try_push(9));
+	int v;
+	CHECK(r->pop(&v) && v == 0);
+	CHECK(r->pop_n(out, 6) == 2 && out[0] == 1 && out[1] == 9);
+	r->close();
+	CHECK(r->push_n(in, 2) == 0);
+	CHECK(r->pop_n(out, 6) == 0);
+	delete r;
+}
+
+/* In order through a ring smaller than the stream, both sides blocking. */
+static void check_threads()
+{
+	const int count = 200000;
+	Ring *r = new Ring;
+	std::thread producer([r] {
+		for (int i = 0; i < count; i++) {
+			if (!r->push(i)) break;
+		}
+		r->close();
+	});
+	int v, expected = 0;
+	bool in_order = true;
+	while (r->pop(&v)) {
+		if (v != expected) in_order = false;
+		expected++;
+	}
+	producer.join();
+	CHECK(in_order);
+	CHECK(expected == count);
+	delete r;
+}
+
+/* The same with batches of varying size on both sides; a batch larger
+ * than the ring goes through in parts. */
+static void check_threads_batched()
+{
+	const int count = 200000;
+	Ring *r = new Ring;
+	std::thread producer([r] {
+		int items[7];
+		for (int i = 0; i < count;) {
+			unsigned n = 1 + i % 7;
+			if (n > (unsigned)(count - i)) n = count - i;
+			for (unsigned k = 0; k < n; k++) {
+				items[k] = i + k;
+			}
+			if (r->push_n(items, n) != n) break;
+			i += n;
+		}
+		r->close();
+	});
+	int items[3], expected = 0;
+	bool in_order = true;
+	unsigned n;
+	while ((n = r->pop_n(items, 3)) > 0) {
+		for (unsigned k = 0; k < n; k++) {
+			if (items[k] != expected) in_order = false;
+			expected++;
+		}
+	}
+	producer.join();
+	CHECK(in_order);
+	CHECK(expected == count);
+	delete r;
+}
+
+/* A free/ready pair as the pipeline uses them: objects go round. */
+static void check_pair()
+{
+	const int frames = 100000;
+	int objects[4];
+	SpscRing<int *, 4> *free_ring = new SpscRing<int *, 4>, *ready_ring = new SpscRing<int *, 4>;
+	for (int i = 0; i < 4; i++) {
+		free_ring->push(&objects[i]);
+	}
+	std::thread producer([&] {
+		int *o;
+		for (int i = 0; i < frames && free_ring->pop(&o); i++) {
+			*o = i;
+			if (!ready_ring->push(o)) break;
+		}
+		ready_ring->close();
+	});
+	int *o, expected = 0;
+	bool in_order = true;
+	while (ready_ring->pop(&o)) {
+		if (*o != expected) in_order = false;
+		expected++;
+		free_ring->push(o);
+	}
+	free_ring->close();
+	producer.join();
+	CHECK(in_order);
+	CHECK(expected == frames);
+	delete free_ring;
+	delete ready_ring;
+}
+
+/* close() wakes a consumer sleeping on an empty ring and a producer
+ * sleeping on a full one. */
+static void check_close_wakes()
+{
+	Ring *r = new Ring;
+	bool popped = true;
+	std::thread consumer([r, &popped] {
+		int v;
+		popped = r->pop(&v);
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	r->close();
+	consumer.join();
+	CHECK(!popped);
+	delete r;
+
+	r = new Ring;
+	for (int i = 0; i < 4; i++) {
+		r->push(i);
+	}
+	bool pushed = true;
+	std::thread producer([r, &pushed] {
+		pushed = r->push(4);
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	r->close();
+	producer.join();
+	CHECK(!pushed);
+	delete r;
+}
+
+int main()
+{
+	check_single_thread();
+	check_batches();
+	check_threads();
+	check_threads_batched();
+	check_pair();
+	check_close_wakes();
+	return check_report("check-ring", nullptr);
+}
@@ -0,0 +1,75 @@
+#include "cpu.h"
+#include <stdint.h>
+#include <string.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#define HAVE_X86_CPUID 1
+#endif
+
+static const char *level_names[CPU_LEVEL_COUNT] = {
+	"scalar",
+	"sse4.1",
+	"avx2",
+	"avx512",
+};
+
+#ifdef HAVE_X86_CPUID
+/* Register state the OS saves on context switches (XCR0). */
+static uint64_t xgetbv0()
+{
+	uint32_t eax, edx;
+	__asm__ volatile ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((uint64_t)edx << 32) | eax;
+}
+#endif
+
+CpuLevel cpu_detect()
+{
+#ifdef HAVE_X86_CPUID
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return CPU_SCALAR;
+	if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) return CPU_SCALAR;
+	CpuLevel level = CPU_SSE41;
+	if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) return level;
+	uint64_t xcr0 = xgetbv0();
+	/* XMM and YMM state */
+	if ((xcr0 & 0x06) != 0x06) return level;
+	if (__get_cpuid_max(0, nullptr) < 7) return level;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	if (!(ebx & bit_AVX2)) return level;
+	level = CPU_AVX2;
+	/* opmask and ZMM state as well */
+	if ((xcr0 & 0xe6) != 0xe6) return level;
+	if ((ebx & bit_AVX512F) && (ebx & bit_AVX512BW)) level = CPU_AVX512;
+	return level;
+#else
+	return CPU_SCALAR;
+#endif
+}
+
+bool cpu_has_crc32c()
+{
+#ifdef HAVE_X86_CPUID
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+	return (ecx & bit_SSE4_2) != 0;
+#else
+	return false;
+#endif
+}
+
+const char *cpu_level_name(CpuLevel level)
+{
+	return level_names[level];
+}
+
+bool cpu_level_from_name(const char *name, CpuLevel *level)
+{
+	for (int i = 0; i < CPU_LEVEL_COUNT; i++) {
+		if (strcmp(level_names[i], name) == 0) {
+			*level = (CpuLevel)i;
+			return true;
+		}
+	}
+	return false;
+}
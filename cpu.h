@@ -0,0 +1,22 @@
+#ifndef CPU_H
+#define CPU_H
+
+/* Instruction set levels the internal kernels are built for, in increasing
+ * order. Each level implies the ones below it. */
+enum CpuLevel {
+	CPU_SCALAR,
+	CPU_SSE41,
+	CPU_AVX2,
+	CPU_AVX512,
+	CPU_LEVEL_COUNT
+};
+
+/* Highest level supported by both the CPU (cpuid) and the operating
+ * system (xgetbv). Always CPU_SCALAR on non-x86 builds. */
+CpuLevel cpu_detect();
+const char *cpu_level_name(CpuLevel level);
+bool cpu_level_from_name(const char *name, CpuLevel *level);
+/* SSE4.2 CRC32 instruction (CRC32C polynomial). */
+bool cpu_has_crc32c();
+
+#endif
@@ -0,0 +1,104 @@
+#include "crc32c.h"
+#include "cpu.h"
+#include <mutex>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h>
+#define HAVE_X86_CRC32 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78 /* reflected */
+
+static uint32_t crc32c_table[256];
+static uint32_t (*crc32c_update)(uint32_t c, const uint8_t *p, size_t len);
+
+static uint32_t crc32c_update_c(uint32_t c, const uint8_t *p, size_t len)
+{
+	while (len--) {
+		c = crc32c_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+	}
+	return c;
+}
+#ifdef HAVE_X86_CRC32
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_update_sse42(uint32_t c, const uint8_t *p, size_t len)
+{
+	for (; len && ((uintptr_t)p & 7); len--) {
+		c = _mm_crc32_u8(c, *p++);
+	}
+#ifdef __x86_64__
+	uint64_t c64 = c;
+	for (; len >= 8; len -= 8, p += 8) {
+		c64 = _mm_crc32_u64(c64, *(const uint64_t *)p);
+	}
+	c = (uint32_t)c64;
+#else
+	for (; len >= 4; len -= 4, p += 4) {
+		c = _mm_crc32_u32(c, *(const uint32_t *)p);
+	}
+#endif
+	for (; len; len--) {
+		c = _mm_crc32_u8(c, *p++);
+	}
+	return c;
+}
+#endif
+
+static void crc32c_init()
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) {
+			c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		}
+		crc32c_table[i] = c;
+	}
+	crc32c_update = crc32c_update_c;
+#ifdef HAVE_X86_CRC32
+	if (cpu_has_crc32c()) crc32c_update = crc32c_update_sse42;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+	static std::once_flag once;
+	std::call_once(once, crc32c_init);
+	return ~crc32c_update(~crc, (const uint8_t *)data, len);
+}
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+	for (; vec; vec >>= 1, mat++) {
+		if (vec & 1) sum ^= *mat;
+	}
+	return sum;
+}
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+	for (int n = 0; n < 32; n++) {
+		square[n] = gf2_matrix_times(mat, mat[n]);
+	}
+}
+/* Applies len2 zero bytes to crc1 as a GF(2) matrix, as zlib does. */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, int64_t len2)
+{
+	uint32_t even[32], odd[32];
+	if (len2 <= 0) return crc1 ^ crc2;
+	/* operator for one zero bit */
+	odd[0] = CRC32C_POLY;
+	for (int n = 1; n < 32; n++) {
+		odd[n] = 1u << (n - 1);
+	}
+	gf2_matrix_square(even, odd); /* two bits */
+	gf2_matrix_square(odd, even); /* four bits */
+	do {
+		gf2_matrix_square(even, odd);
+		if (len2 & 1) crc1 = gf2_matrix_times(even, crc1);
+		len2 >>= 1;
+		if (!len2) break;
+		gf2_matrix_square(odd, even);
+		if (len2 & 1) crc1 = gf2_matrix_times(odd, crc1);
+		len2 >>= 1;
+	} while (len2);
+	return crc1 ^ crc2;
+}
@@ -0,0 +1,13 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC32C (Castagnoli) of len bytes, continuing from crc (0 to start).
+ * Uses the SSE4.2 instruction when the CPU has it. */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+/* CRC of A followed by B from crc(A), crc(B) and the length of B. */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, int64_t len2);
+
+#endif
@@ -6,12 +6,52 @@ CONFIG -= qt app_bundle
 
 DESTDIR = $$PWD/_bin
 
+# Needs FFmpeg 5.1 or later (AVChannelLayout). On Windows, an unpacked
+# shared build; another one with qmake FFMPEG_DIR=...
 win32 {
-	INCLUDEPATH += D:/ffmpeg-4.1.3-win32-dev/include
-	LIBS += -LD:/ffmpeg-4.1.3-win32-dev/lib
+	isEmpty(FFMPEG_DIR): FFMPEG_DIR = D:/ffmpeg-5.1.2-full_build-shared
+	INCLUDEPATH += $$FFMPEG_DIR/include
+	LIBS += -L$$FFMPEG_DIR/lib
 }
 
 LIBS += -lavutil -lavcodec -lavformat -lswscale -lswresample
+unix:LIBS += -lpthread
+
+# qmake CONFIG+=memprof: count heap allocations for -memprof (glibc only)
+memprof: DEFINES += MEMPROF_HOOKS
+
+# Release builds: -O3 and link-time optimization. No -march, the kernels
+# pick their instruction set at run time.
+CONFIG(release, debug|release) {
+	CONFIG += ltcg
+	!msvc {
+		QMAKE_CXXFLAGS_RELEASE -= -O2
+		QMAKE_CXXFLAGS_RELEASE += -O3
+	}
+}
 
 SOURCES += \
-	main.cpp
+	bench.cpp \
+	cpu.cpp \
+	crc32c.cpp \
+	kernels.cpp \
+	main.cpp \
+	manifest.cpp \
+	memprof.cpp \
+	perfcount.cpp \
+	slicepool.cpp \
+	statslog.cpp
+
+HEADERS += \
+	alignedmem.h \
+	bench.h \
+	budget.h \
+	cpu.h \
+	crc32c.h \
+	kernels.h \
+	manifest.h \
+	memprof.h \
+	perfcount.h \
+	ringbuffer.h \
+	slicepool.h \
+	statslog.h
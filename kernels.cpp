@@ -0,0 +1,1040 @@
+#include "kernels.h"
+#include "alignedmem.h"
+#include <mutex>
+#include <stddef.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+/* BT.601 limited range, 8 bit fixed point */
+#define RGB_Y(r, g, b) (((66 * (r) + 129 * (g) + 25 * (b) + 128) >> 8) + 16)
+#define RGB_U(r, g, b) (((-38 * (r) - 74 * (g) + 112 * (b) + 128) >> 8) + 128)
+#define RGB_V(r, g, b) (((112 * (r) - 94 * (g) - 18 * (b) + 128) >> 8) + 128)
+
+/* Unroll the block loops; with a constant width the trip count is known
+ * and the stores of consecutive blocks are scheduled together. */
+#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 8)
+#define KERNEL_UNROLL _Pragma("GCC unroll 2")
+#else
+#define KERNEL_UNROLL
+#endif
+
+/**************************************************************/
+/* scalar */
+
+/* Pattern pixels [x, end) of row y. Also the tail of the SIMD variants. */
+static inline void pattern_pixels_c(uint8_t *p, const PatternLut *lut, int x, int end, int y, int i)
+{
+	const uint8_t *blue = lut->blue + (i & 127);
+	uint8_t g = lut->row_ramp[y];
+	uint8_t inv = ((y + i) & 64) ? 0xff : 0;
+	p += 3 * x;
+	for (; x < end; x++) {
+		p[0] = lut->col_ramp[x];
+		p[1] = g;
+		p[2] = blue[x] ^ inv;
+		p += 3;
+	}
+}
+template <int W>
+static void pattern_row_c(uint8_t *dst, const PatternLut *lut, int y, int frame_index)
+{
+	const int width = W ? W : lut->width;
+	pattern_pixels_c(dst, lut, 0, width, y, frame_index);
+}
+
+/* 10 bit: luma from the same weights with two more fractional bits, chroma
+ * from the sum of a 2x2 block (four times the average) */
+#define RGB_Y10(r, g, b) (((66 * (r) + 129 * (g) + 25 * (b) + 32) >> 6) + 64)
+#define RGB_C10(kr, kg, kb, rs, gs, bs) ((((kr) * (rs) + (kg) * (gs) + (kb) * (bs) + 128) >> 8) + 512)
+
+/* The conversions below write plane rows through d0 (source row 0) and d1
+ * (source row 1). Vertically subsampled chroma is written through d0 only;
+ * an odd last column is paired with itself. x must be even. */
+
+/* 4:2:0, 8 bit, planar (YUV420P) or with interleaved chroma (NV12) */
+template <bool SEMI>
+static inline void yuv420_pixels_c(const uint8_t *src0, const uint8_t *src1, uint8_t *const *d0, uint8_t *const *d1, int x, int width)
+{
+	for (; x < width; x += 2) {
+		int x1 = x + 1 < width ? x + 1 : x;
+		const uint8_t *a = src0 + 3 * x, *b = src0 + 3 * x1;
+		const uint8_t *c = src1 + 3 * x, *d = src1 + 3 * x1;
+		d0[0][x]  = RGB_Y(a[0], a[1], a[2]);
+		d0[0][x1] = RGB_Y(b[0], b[1], b[2]);
+		d1[0][x]  = RGB_Y(c[0], c[1], c[2]);
+		d1[0][x1] = RGB_Y(d[0], d[1], d[2]);
+		int r = (a[0] + b[0] + c[0] + d[0] + 2) >> 2;
+		int g = (a[1] + b[1] + c[1] + d[1] + 2) >> 2;
+		int bl = (a[2] + b[2] + c[2] + d[2] + 2) >> 2;
+		if (SEMI) {
+			d0[1][x]     = RGB_U(r, g, bl);
+			d0[1][x + 1] = RGB_V(r, g, bl);
+		} else {
+			d0[1][x / 2] = RGB_U(r, g, bl);
+			d0[2][x / 2] = RGB_V(r, g, bl);
+		}
+	}
+}
+/* 4:2:2, one row */
+static inline void yuv422_pixels_c(const uint8_t *src, uint8_t *const *d, int x, int width)
+{
+	for (; x < width; x += 2) {
+		int x1 = x + 1 < width ? x + 1 : x;
+		const uint8_t *a = src + 3 * x, *b = src + 3 * x1;
+		d[0][x]  = RGB_Y(a[0], a[1], a[2]);
+		d[0][x1] = RGB_Y(b[0], b[1], b[2]);
+		int r = (a[0] + b[0] + 1) >> 1;
+		int g = (a[1] + b[1] + 1) >> 1;
+		int bl = (a[2] + b[2] + 1) >> 1;
+		d[1][x / 2] = RGB_U(r, g, bl);
+		d[2][x / 2] = RGB_V(r, g, bl);
+	}
+}
+/* 4:4:4, one row */
+static inline void yuv444_pixels_c(const uint8_t *src, uint8_t *const *d, int x, int width)
+{
+	for (; x < width; x++) {
+		const uint8_t *a = src + 3 * x;
+		d[0][x] = RGB_Y(a[0], a[1], a[2]);
+		d[1][x] = RGB_U(a[0], a[1], a[2]);
+		d[2][x] = RGB_V(a[0], a[1], a[2]);
+	}
+}
+/* 4:2:0, 10 bit little endian words: planar with the value in the low bits
+ * (YUV420P10LE) or with interleaved chroma in the high bits (P010LE) */
+template <bool SEMI>
+static inline void yuv420_10_pixels_c(const uint8_t *src0, const uint8_t *src1, uint8_t *const *d0, uint8_t *const *d1, int x, int width)
+{
+	const int shift = SEMI ? 6 : 0;
+	uint16_t *y0 = (uint16_t *)d0[0], *y1 = (uint16_t *)d1[0];
+	uint16_t *u = (uint16_t *)d0[1], *v = (uint16_t *)d0[2];
+	for (; x < width; x += 2) {
+		int x1 = x + 1 < width ? x + 1 : x;
+		const uint8_t *a = src0 + 3 * x, *b = src0 + 3 * x1;
+		const uint8_t *c = src1 + 3 * x, *d = src1 + 3 * x1;
+		y0[x]  = RGB_Y10(a[0], a[1], a[2]) << shift;
+		y0[x1] = RGB_Y10(b[0], b[1], b[2]) << shift;
+		y1[x]  = RGB_Y10(c[0], c[1], c[2]) << shift;
+		y1[x1] = RGB_Y10(d[0], d[1], d[2]) << shift;
+		int rs = a[0] + b[0] + c[0] + d[0];
+		int gs = a[1] + b[1] + c[1] + d[1];
+		int bs = a[2] + b[2] + c[2] + d[2];
+		if (SEMI) {
+			u[x]     = RGB_C10(-38, -74, 112, rs, gs, bs) << shift;
+			u[x + 1] = RGB_C10(112, -94, -18, rs, gs, bs) << shift;
+		} else {
+			u[x / 2] = RGB_C10(-38, -74, 112, rs, gs, bs);
+			v[x / 2] = RGB_C10(112, -94, -18, rs, gs, bs);
+		}
+	}
+}
+/* Pixels [x, width) of a row pair in format F. */
+template <KernelPixFmt F>
+static inline void yuv_pixels_c(const uint8_t *src0, const uint8_t *src1, uint8_t *const *d0, uint8_t *const *d1, int x, int width)
+{
+	switch (F) {
+	case KPIX_YUV420P:
+		yuv420_pixels_c<false>(src0, src1, d0, d1, x, width);
+		break;
+	case KPIX_NV12:
+		yuv420_pixels_c<true>(src0, src1, d0, d1, x, width);
+		break;
+	case KPIX_YUV422P:
+		yuv422_pixels_c(src0, d0, x, width);
+		yuv422_pixels_c(src1, d1, x, width);
+		break;
+	case KPIX_YUV444P:
+		yuv444_pixels_c(src0, d0, x, width);
+		yuv444_pixels_c(src1, d1, x, width);
+		break;
+	case KPIX_YUV420P10:
+		yuv420_10_pixels_c<false>(src0, src1, d0, d1, x, width);
+		break;
+	case KPIX_P010:
+		yuv420_10_pixels_c<true>(src0, src1, d0, d1, x, width);
+		break;
+	default:
+		break;
+	}
+}
+template <KernelPixFmt F, int W>
+static void to_yuv_rows_c(const uint8_t *src0, const uint8_t *src1, uint8_t *const *d0, uint8_t *const *d1, int runtime_width)
+{
+	const int width = W ? W : runtime_width;
+	yuv_pixels_c<F>(src0, src1, d0, d1, 0, width);
+}
+
+/* Pattern pixels [x, width) of rows y0 and y1 straight to YUV420P, with
+ * the same arithmetic as pattern_pixels_c() followed by
+ * yuv420_pixels_c(). */
+static inline void pattern_yuv420_pixels_c(const PatternLut *lut, int y0, int y1, int i, uint8_t *const *d0, uint8_t *const *d1, int x, int width)
+{
+	const uint8_t *blue = lut->blue + (i & 127);
+	int g0 = lut->row_ramp[y0], g1 = lut->row_ramp[y1];
+	int inv0 = ((y0 + i) & 64) ? 0xff : 0, inv1 = ((y1 + i) & 64) ? 0xff : 0;
+	int g = (2 * g0 + 2 * g1 + 2) >> 2;
+	for (; x < width; x += 2) {
+		int x1 = x + 1 < width ? x + 1 : x;
+		int ra = lut->col_ramp[x], rb = lut->col_ramp[x1];
+		int ba0 = blue[x] ^ inv0, bb0 = blue[x1] ^ inv0;
+		int ba1 = blue[x] ^ inv1, bb1 = blue[x1] ^ inv1;
+		d0[0][x]  = RGB_Y(ra, g0, ba0);
+		d0[0][x1] = RGB_Y(rb, g0, bb0);
+		d1[0][x]  = RGB_Y(ra, g1, ba1);
+		d1[0][x1] = RGB_Y(rb, g1, bb1);
+		int r = (2 * ra + 2 * rb + 2) >> 2;
+		int b = (ba0 + bb0 + ba1 + bb1 + 2) >> 2;
+		d0[1][x / 2] = RGB_U(r, g, b);
+		d0[2][x / 2] = RGB_V(r, g, b);
+	}
+}
+template <int W>
+static void pattern_yuv420p_c(const PatternLut *lut, int y, int frame_index, uint8_t *const *d0, uint8_t *const *d1)
+{
+	const int width = W ? W : lut->width;
+	const int y1 = y + 1 < lut->height ? y + 1 : y;
+	pattern_yuv420_pixels_c(lut, y, y1, frame_index, d0, d1, 0, width);
+}
+
+/* Test tone: sin(2 pi u / 2^32) * 10000, truncated, to within 1, from the
+ * top 32 bits of the phase. The quarter wave is folded onto [0, pi / 2]
+ * as x, Q15, and x * (C1 + x^2 (C3 + x^2 (C5 + x^2 C7))) evaluated with
+ * 32-bit products (minimax coefficients, scaled by 40000). Integer
+ * arithmetic, so that every level gives the same samples. */
+#define SINE_C1 62832
+#define SINE_C3 (-25836)
+#define SINE_C5 3177
+#define SINE_C7 (-173)
+
+static inline int16_t sine_c(uint32_t u)
+{
+	int32_t sign = -(int32_t)(u >> 31);
+	uint32_t v = u & 0x7fffffff;
+	if (v > 0x80000000u - v) v = 0x80000000u - v;
+	int32_t x = v >> 15;
+	int32_t x2 = (x * x) >> 15;
+	int32_t r = SINE_C7;
+	r = SINE_C5 + ((r * x2) >> 15);
+	r = SINE_C3 + ((r * x2) >> 15);
+	r = SINE_C1 + ((r * x2) >> 15);
+	int32_t out = (r * x) >> 17;
+	return (int16_t)((out ^ sign) - sign);
+}
+static void audio_synth_c(int16_t *dst, int n, uint64_t phase, uint64_t incr, uint64_t incr2)
+{
+	for (int j = 0; j < n; j++) {
+		dst[j] = sine_c((uint32_t)(phase >> 32));
+		phase += incr;
+		incr += incr2;
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+/* Start of 'lanes' accumulators that each step 'lanes' samples: lane k
+ * holds sample k, and its step grows by lanes^2 * incr2 every time. */
+static void audio_lanes(uint64_t *phase_k, uint64_t *step_k, int lanes, uint64_t phase, uint64_t incr, uint64_t incr2)
+{
+	uint64_t first = lanes * incr + (uint64_t)lanes * (lanes - 1) / 2 * incr2;
+	for (int k = 0; k < lanes; k++) {
+		phase_k[k] = phase;
+		step_k[k] = first + (uint64_t)lanes * k * incr2;
+		phase += incr;
+		incr += incr2;
+	}
+}
+/* Samples [done, n) with the scalar code. */
+static void audio_tail(int16_t *dst, int done, int n, uint64_t phase, uint64_t incr, uint64_t incr2)
+{
+	if (done == n) return;
+	audio_synth_advance(&phase, &incr, incr2, done);
+	audio_synth_c(dst + done, n - done, phase, incr, incr2);
+}
+
+/**************************************************************/
+/* SSE4.1
+ *
+ * The 16 pixel helpers below are shared by all SIMD levels: RGB24 is
+ * (de)interleaved per 16 pixels with pshufb, wider levels only widen the
+ * arithmetic. Rows come from alloc_picture(), so every block starts on a
+ * 16 byte boundary (48 bytes per 16 pixels) and aligned access is used. */
+
+/* 16 pixels of RGB24 to three planes of 16 bytes */
+__attribute__((target("sse4.1")))
+static inline void load_rgb16(const uint8_t *src, __m128i *r, __m128i *g, __m128i *b)
+{
+	__m128i c0 = _mm_load_si128((const __m128i *)src);
+	__m128i c1 = _mm_load_si128((const __m128i *)(src + 16));
+	__m128i c2 = _mm_load_si128((const __m128i *)(src + 32));
+	*r = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(c0, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(c1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(c2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+	*g = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(c0, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(c1, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(c2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+	*b = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(c0, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(c1, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(c2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+}
+/* three planes of 16 bytes to 16 pixels of RGB24 */
+__attribute__((target("sse4.1")))
+static inline void store_rgb16(uint8_t *dst, __m128i r, __m128i g, __m128i b)
+{
+	__m128i c0 = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(r, _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5)),
+		_mm_shuffle_epi8(g, _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1))),
+		_mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1)));
+	__m128i c1 = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(r, _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1)),
+		_mm_shuffle_epi8(g, _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10))),
+		_mm_shuffle_epi8(b, _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1)));
+	__m128i c2 = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(r, _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1)),
+		_mm_shuffle_epi8(g, _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1))),
+		_mm_shuffle_epi8(b, _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15)));
+	_mm_store_si128((__m128i *)dst, c0);
+	_mm_store_si128((__m128i *)(dst + 16), c1);
+	_mm_store_si128((__m128i *)(dst + 32), c2);
+}
+/* Blue channel of the pattern for pixels x..x+15 from the LUT, which is
+ * offset by the frame index and so not aligned. */
+__attribute__((target("sse4.1")))
+static inline __m128i pattern_blue16(const uint8_t *blue, int x, __m128i inv)
+{
+	return _mm_xor_si128(_mm_loadu_si128((const __m128i *)(blue + x)), inv);
+}
+
+template <int W>
+__attribute__((target("sse4.1")))
+static void pattern_row_sse41(uint8_t *dst, const PatternLut *lut, int y, int frame_index)
+{
+	const int width = W ? W : lut->width;
+	const uint8_t *blue = lut->blue + (frame_index & 127);
+	const __m128i g = _mm_set1_epi8((char)lut->row_ramp[y]);
+	const __m128i inv = _mm_set1_epi8(((y + frame_index) & 64) ? -1 : 0);
+	int x = 0;
+	KERNEL_UNROLL
+	for (; x + 16 <= width; x += 16) {
+		__m128i r = _mm_load_si128((const __m128i *)(lut->col_ramp + x));
+		store_rgb16(dst + 3 * x, r, g, pattern_blue16(blue, x, inv));
+	}
+	if (!W || W % 16) {
+		pattern_pixels_c(dst, lut, x, width, y, frame_index);
+	}
+}
+
+/* (66 R + 129 G + 25 B + 128) >> 8 for eight 16 bit pixels. The sum stays
+ * below 65536, so the wrapped 16 bit products add up correctly. */
+__attribute__((target("sse4.1")))
+static inline __m128i luma8(__m128i r, __m128i g, __m128i b)
+{
+	__m128i s = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)), _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+	s = _mm_add_epi16(s, _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(25)), _mm_set1_epi16(128)));
+	return _mm_srli_epi16(s, 8);
+}
+__attribute__((target("sse4.1")))
+static inline __m128i luma16(__m128i r, __m128i g, __m128i b)
+{
+	const __m128i z = _mm_setzero_si128();
+	__m128i lo = luma8(_mm_unpacklo_epi8(r, z), _mm_unpacklo_epi8(g, z), _mm_unpacklo_epi8(b, z));
+	__m128i hi = luma8(_mm_unpackhi_epi8(r, z), _mm_unpackhi_epi8(g, z), _mm_unpackhi_epi8(b, z));
+	return _mm_add_epi8(_mm_packus_epi16(lo, hi), _mm_set1_epi8(16));
+}
+/* One chroma component from 16 bit sums of 2x2 blocks; the products stay
+ * within +-28688. */
+__attribute__((target("sse4.1")))
+static inline __m128i chroma8(__m128i rs, __m128i gs, __m128i bs, int kr, int kg, int kb)
+{
+	const __m128i two = _mm_set1_epi16(2);
+	__m128i r = _mm_srli_epi16(_mm_add_epi16(rs, two), 2);
+	__m128i g = _mm_srli_epi16(_mm_add_epi16(gs, two), 2);
+	__m128i b = _mm_srli_epi16(_mm_add_epi16(bs, two), 2);
+	__m128i s = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(kr)), _mm_mullo_epi16(g, _mm_set1_epi16(kg)));
+	s = _mm_add_epi16(s, _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(kb)), _mm_set1_epi16(128)));
+	return _mm_add_epi16(_mm_srai_epi16(s, 8), _mm_set1_epi16(128));
+}
+
+/* 10 bit luma of eight 16 bit pixels; 220 * 255 + 32 still fits. */
+__attribute__((target("sse4.1")))
+static inline __m128i luma10_8(__m128i r, __m128i g, __m128i b, int shift)
+{
+	__m128i s = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)), _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+	s = _mm_add_epi16(s, _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(25)), _mm_set1_epi16(32)));
+	s = _mm_add_epi16(_mm_srli_epi16(s, 6), _mm_set1_epi16(64));
+	return _mm_slli_epi16(s, shift);
+}
+__attribute__((target("sse4.1")))
+static inline void store_luma10_16(uint8_t *dst, __m128i r, __m128i g, __m128i b, int shift)
+{
+	const __m128i z = _mm_setzero_si128();
+	_mm_store_si128((__m128i *)dst, luma10_8(_mm_unpacklo_epi8(r, z), _mm_unpacklo_epi8(g, z), _mm_unpacklo_epi8(b, z), shift));
+	_mm_store_si128((__m128i *)(dst + 16), luma10_8(_mm_unpackhi_epi8(r, z), _mm_unpackhi_epi8(g, z), _mm_unpackhi_epi8(b, z), shift));
+}
+/* 10 bit chroma from the 16 bit sums of eight 2x2 blocks. Without the
+ * division the products need 32 bits: R and G go through one madd, B
+ * through another paired with the rounding constant. */
+__attribute__((target("sse4.1")))
+static inline __m128i chroma10_8(__m128i rs, __m128i gs, __m128i bs, int kr, int kg, int kb, int shift)
+{
+	const __m128i krg = _mm_set1_epi32((kg << 16) | (kr & 0xffff));
+	const __m128i kb1 = _mm_set1_epi32((1 << 16) | (kb & 0xffff));
+	const __m128i round = _mm_set1_epi16(128);
+	__m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(rs, gs), krg), _mm_madd_epi16(_mm_unpacklo_epi16(bs, round), kb1));
+	__m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(rs, gs), krg), _mm_madd_epi16(_mm_unpackhi_epi16(bs, round), kb1));
+	__m128i s = _mm_packs_epi32(_mm_srai_epi32(lo, 8), _mm_srai_epi32(hi, 8));
+	return _mm_slli_epi16(_mm_add_epi16(s, _mm_set1_epi16(512)), shift);
+}
+/* U and V of 16 pixels of one row at full resolution (4:4:4). */
+__attribute__((target("sse4.1")))
+static inline void chroma444_16(uint8_t *u, uint8_t *v, __m128i r, __m128i g, __m128i b)
+{
+	/* chroma8 divides its sums by four */
+	const __m128i z = _mm_setzero_si128();
+	__m128i rl = _mm_slli_epi16(_mm_unpacklo_epi8(r, z), 2), rh = _mm_slli_epi16(_mm_unpackhi_epi8(r, z), 2);
+	__m128i gl = _mm_slli_epi16(_mm_unpacklo_epi8(g, z), 2), gh = _mm_slli_epi16(_mm_unpackhi_epi8(g, z), 2);
+	__m128i bl = _mm_slli_epi16(_mm_unpacklo_epi8(b, z), 2), bh = _mm_slli_epi16(_mm_unpackhi_epi8(b, z), 2);
+	_mm_store_si128((__m128i *)u, _mm_packus_epi16(chroma8(rl, gl, bl, -38, -74, 112), chroma8(rh, gh, bh, -38, -74, 112)));
+	_mm_store_si128((__m128i *)v, _mm_packus_epi16(chroma8(rl, gl, bl, 112, -94, -18), chroma8(rh, gh, bh, 112, -94, -18)));
+}
+
+template <KernelPixFmt F, int W>
+__attribute__((target("sse4.1")))
+static void to_yuv_rows_sse41(const uint8_t *src0, const uint8_t *src1, uint8_t *const *d0, uint8_t *const *d1, int runtime_width)
+{
+	const int width = W ? W : runtime_width;
+	const __m128i ones = _mm_set1_epi8(1);
+	const int shift = F == KPIX_P010 ? 6 : 0;
+	int x = 0;
+	KERNEL_UNROLL
+	for (; x + 16 <= width; x += 16) {
+		__m128i r0, g0, b0, r1, g1, b1;
+		load_rgb16(src0 + 3 * x, &r0, &g0, &b0);
+		load_rgb16(src1 + 3 * x, &r1, &g1, &b1);
+		if (F == KPIX_YUV420P10 || F == KPIX_P010) {
+			store_luma10_16(d0[0] + 2 * x, r0, g0, b0, shift);
+			store_luma10_16(d1[0] + 2 * x, r1, g1, b1, shift);
+		} else {
+			_mm_store_si128((__m128i *)(d0[0] + x), luma16(r0, g0, b0));
+			_mm_store_si128((__m128i *)(d1[0] + x), luma16(r1, g1, b1));
+		}
+		if (F == KPIX_YUV444P) {
+			chroma444_16(d0[1] + x, d0[2] + x, r0, g0, b0);
+			chroma444_16(d1[1] + x, d1[2] + x, r1, g1, b1);
+			continue;
+		}
+		/* horizontal pair sums of each row */
+		__m128i rs0 = _mm_maddubs_epi16(r0, ones), rs1 = _mm_maddubs_epi16(r1, ones);
+		__m128i gs0 = _mm_maddubs_epi16(g0, ones), gs1 = _mm_maddubs_epi16(g1, ones);
+		__m128i bs0 = _mm_maddubs_epi16(b0, ones), bs1 = _mm_maddubs_epi16(b1, ones);
+		if (F == KPIX_YUV422P) {
+			/* doubled, so that chroma8 averages the pair */
+			rs0 = _mm_add_epi16(rs0, rs0); rs1 = _mm_add_epi16(rs1, rs1);
+			gs0 = _mm_add_epi16(gs0, gs0); gs1 = _mm_add_epi16(gs1, gs1);
+			bs0 = _mm_add_epi16(bs0, bs0); bs1 = _mm_add_epi16(bs1, bs1);
+			__m128i cu0 = chroma8(rs0, gs0, bs0, -38, -74, 112), cu1 = chroma8(rs1, gs1, bs1, -38, -74, 112);
+			__m128i cv0 = chroma8(rs0, gs0, bs0, 112, -94, -18), cv1 = chroma8(rs1, gs1, bs1, 112, -94, -18);
+			_mm_storel_epi64((__m128i *)(d0[1] + x / 2), _mm_packus_epi16(cu0, cu0));
+			_mm_storel_epi64((__m128i *)(d0[2] + x / 2), _mm_packus_epi16(cv0, cv0));
+			_mm_storel_epi64((__m128i *)(d1[1] + x / 2), _mm_packus_epi16(cu1, cu1));
+			_mm_storel_epi64((__m128i *)(d1[2] + x / 2), _mm_packus_epi16(cv1, cv1));
+			continue;
+		}
+		__m128i rs = _mm_add_epi16(rs0, rs1);
+		__m128i gs = _mm_add_epi16(gs0, gs1);
+		__m128i bs = _mm_add_epi16(bs0, bs1);
+		if (F == KPIX_YUV420P10 || F == KPIX_P010) {
+			__m128i cu = chroma10_8(rs, gs, bs, -38, -74, 112, shift);
+			__m128i cv = chroma10_8(rs, gs, bs, 112, -94, -18, shift);
+			if (F == KPIX_P010) {
+				_mm_store_si128((__m128i *)(d0[1] + 2 * x), _mm_unpacklo_epi16(cu, cv));
+				_mm_store_si128((__m128i *)(d0[1] + 2 * x + 16), _mm_unpackhi_epi16(cu, cv));
+			} else {
+				_mm_store_si128((__m128i *)(d0[1] + x), cu);
+				_mm_store_si128((__m128i *)(d0[2] + x), cv);
+			}
+			continue;
+		}
+		__m128i cu = chroma8(rs, gs, bs, -38, -74, 112);
+		__m128i cv = chroma8(rs, gs, bs, 112, -94, -18);
+		if (F == KPIX_NV12) {
+			/* both fit in a byte: U in the low one, V in the high one */
+			_mm_store_si128((__m128i *)(d0[1] + x), _mm_or_si128(cu, _mm_slli_epi16(cv, 8)));
+		} else {
+			_mm_storel_epi64((__m128i *)(d0[1] + x / 2), _mm_packus_epi16(cu, cu));
+			_mm_storel_epi64((__m128i *)(d0[2] + x / 2), _mm_packus_epi16(cv, cv));
+		}
+	}
+	if (!W || W % 16) {
+		yuv_pixels_c<F>(src0, src1, d0, d1, x, width);
+	}
+}
+
+/* Fused pattern and 4:2:0 conversion: R and B come from the pattern
+ * tables, G is constant along a row, so its chroma sums are too. */
+template <int W>
+__attribute__((target("sse4.1")))
+static void pattern_yuv420p_sse41(const PatternLut *lut, int y, int frame_index, uint8_t *const *d0, uint8_t *const *d1)
+{
+	const int width = W ? W : lut->width;
+	const int y1 = y + 1 < lut->height ? y + 1 : y;
+	const uint8_t *blue = lut->blue + (frame_index & 127);
+	uint8_t *ya = d0[0], *yb = d1[0], *u = d0[1], *v = d0[2];
+	const __m128i ones = _mm_set1_epi8(1);
+	const __m128i g0 = _mm_set1_epi8((char)lut->row_ramp[y]);
+	const __m128i g1 = _mm_set1_epi8((char)lut->row_ramp[y1]);
+	const __m128i inv0 = _mm_set1_epi8(((y + frame_index) & 64) ? -1 : 0);
+	const __m128i inv1 = _mm_set1_epi8(((y1 + frame_index) & 64) ? -1 : 0);
+	const __m128i gs = _mm_set1_epi16(2 * (lut->row_ramp[y] + lut->row_ramp[y1]));
+	int x = 0;
+	KERNEL_UNROLL
+	for (; x + 16 <= width; x += 16) {
+		__m128i r = _mm_load_si128((const __m128i *)(lut->col_ramp + x));
+		__m128i b0 = pattern_blue16(blue, x, inv0);
+		__m128i b1 = pattern_blue16(blue, x, inv1);
+		_mm_store_si128((__m128i *)(ya + x), luma16(r, g0, b0));
+		_mm_store_si128((__m128i *)(yb + x), luma16(r, g1, b1));
+		__m128i rs = _mm_maddubs_epi16(r, ones);
+		rs = _mm_add_epi16(rs, rs);
+		__m128i bs = _mm_add_epi16(_mm_maddubs_epi16(b0, ones), _mm_maddubs_epi16(b1, ones));
+		__m128i cu = chroma8(rs, gs, bs, -38, -74, 112);
+		__m128i cv = chroma8(rs, gs, bs, 112, -94, -18);
+		_mm_storel_epi64((__m128i *)(u + x / 2), _mm_packus_epi16(cu, cu));
+		_mm_storel_epi64((__m128i *)(v + x / 2), _mm_packus_epi16(cv, cv));
+	}
+	if (!W || W % 16) {
+		pattern_yuv420_pixels_c(lut, y, y1, frame_index, d0, d1, x, width);
+	}
+}
+
+/* sine_c() on four phases */
+__attribute__((target("sse4.1")))
+static inline __m128i sine_sse41(__m128i u)
+{
+	__m128i sign = _mm_srai_epi32(u, 31);
+	__m128i v = _mm_and_si128(u, _mm_set1_epi32(0x7fffffff));
+	v = _mm_min_epu32(v, _mm_sub_epi32(_mm_set1_epi32(INT32_MIN), v));
+	__m128i x = _mm_srli_epi32(v, 15);
+	__m128i x2 = _mm_srli_epi32(_mm_mullo_epi32(x, x), 15);
+	__m128i r = _mm_set1_epi32(SINE_C7);
+	r = _mm_add_epi32(_mm_set1_epi32(SINE_C5), _mm_srai_epi32(_mm_mullo_epi32(r, x2), 15));
+	r = _mm_add_epi32(_mm_set1_epi32(SINE_C3), _mm_srai_epi32(_mm_mullo_epi32(r, x2), 15));
+	r = _mm_add_epi32(_mm_set1_epi32(SINE_C1), _mm_srai_epi32(_mm_mullo_epi32(r, x2), 15));
+	__m128i out = _mm_srai_epi32(_mm_mullo_epi32(r, x), 17);
+	return _mm_sub_epi32(_mm_xor_si128(out, sign), sign);
+}
+/* top halves of the 64-bit phases in a and b, in order */
+__attribute__((target("sse4.1")))
+static inline __m128i phase_hi_sse41(__m128i a, __m128i b)
+{
+	return _mm_unpacklo_epi64(_mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 3, 1)), _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 3, 1)));
+}
+__attribute__((target("sse4.1")))
+static void audio_synth_sse41(int16_t *dst, int n, uint64_t phase, uint64_t incr, uint64_t incr2)
+{
+	uint64_t phase_k[8], step_k[8];
+	audio_lanes(phase_k, step_k, 8, phase, incr, incr2);
+	__m128i p[4], st[4];
+	for (int i = 0; i < 4; i++) {
+		p[i] = _mm_loadu_si128((const __m128i *)(phase_k + 2 * i));
+		st[i] = _mm_loadu_si128((const __m128i *)(step_k + 2 * i));
+	}
+	const __m128i growth = _mm_set1_epi64x((long long)(64 * incr2));
+	int j = 0;
+	for (; j + 8 <= n; j += 8) {
+		__m128i lo = sine_sse41(phase_hi_sse41(p[0], p[1]));
+		__m128i hi = sine_sse41(phase_hi_sse41(p[2], p[3]));
+		_mm_storeu_si128((__m128i *)(dst + j), _mm_packs_epi32(lo, hi));
+		for (int i = 0; i < 4; i++) {
+			p[i] = _mm_add_epi64(p[i], st[i]);
+			st[i] = _mm_add_epi64(st[i], growth);
+		}
+	}
+	audio_tail(dst, j, n, phase, incr, incr2);
+}
+
+/**************************************************************/
+/* AVX2 */
+
+template <int W>
+__attribute__((target("avx2")))
+static void pattern_row_avx2(uint8_t *dst, const PatternLut *lut, int y, int frame_index)
+{
+	const int width = W ? W : lut->width;
+	const uint8_t *blue = lut->blue + (frame_index & 127);
+	const __m128i g = _mm_set1_epi8((char)lut->row_ramp[y]);
+	const __m256i inv = _mm256_set1_epi8(((y + frame_index) & 64) ? -1 : 0);
+	int x = 0;
+	KERNEL_UNROLL
+	for (; x + 32 <= width; x += 32) {
+		__m256i r = _mm256_load_si256((const __m256i *)(lut->col_ramp + x));
+		__m256i b = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(blue + x)), inv);
+		store_rgb16(dst + 3 * x, _mm256_castsi256_si128(r), g, _mm256_castsi256_si128(b));
+		store_rgb16(dst + 3 * x + 48, _mm256_extracti128_si256(r, 1), g, _mm256_extracti128_si256(b, 1));
+	}
+	if (!W || W % 32) {
+		pattern_pixels_c(dst, lut, x, width, y, frame_index);
+	}
+}
+
+__attribute__((target("avx2")))
+static inline void load_rgb32(const uint8_t *src, __m256i *r, __m256i *g, __m256i *b)
+{
+	__m128i r0, g0, b0, r1, g1, b1;
+	load_rgb16(src, &r0, &g0, &b0);
+	load_rgb16(src + 48, &r1, &g1, &b1);
+	*r = _mm256_inserti128_si256(_mm256_castsi128_si256(r0), r1, 1);
+	*g = _mm256_inserti128_si256(_mm256_castsi128_si256(g0), g1, 1);
+	*b = _mm256_inserti128_si256(_mm256_castsi128_si256(b0), b1, 1);
+}
+__attribute__((target("avx2")))
+static inline __m256i luma16_avx2(__m256i r, __m256i g, __m256i b)
+{
+	__m256i s = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(66)), _mm256_mullo_epi16(g, _mm256_set1_epi16(129)));
+	s = _mm256_add_epi16(s, _mm256_add_epi16(_mm256_mullo_epi16(b, _mm256_set1_epi16(25)), _mm256_set1_epi16(128)));
+	return _mm256_srli_epi16(s, 8);
+}
+/* unpack and pack both work within 128 bit lanes, so the byte order
+ * comes out unchanged */
+__attribute__((target("avx2")))
+static inline __m256i luma32_avx2(__m256i r, __m256i g, __m256i b)
+{
+	const __m256i z = _mm256_setzero_si256();
+	__m256i lo = luma16_avx2(_mm256_unpacklo_epi8(r, z), _mm256_unpacklo_epi8(g, z), _mm256_unpacklo_epi8(b, z));
+	__m256i hi = luma16_avx2(_mm256_unpackhi_epi8(r, z), _mm256_unpackhi_epi8(g, z), _mm256_unpackhi_epi8(b, z));
+	return _mm256_add_epi8(_mm256_packus_epi16(lo, hi), _mm256_set1_epi8(16));
+}
+__attribute__((target("avx2")))
+static inline __m128i chroma16_avx2(__m256i rs, __m256i gs, __m256i bs, int kr, int kg, int kb)
+{
+	const __m256i two = _mm256_set1_epi16(2);
+	__m256i r = _mm256_srli_epi16(_mm256_add_epi16(rs, two), 2);
+	__m256i g = _mm256_srli_epi16(_mm256_add_epi16(gs, two), 2);
+	__m256i b = _mm256_srli_epi16(_mm256_add_epi16(bs, two), 2);
+	__m256i s = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(kr)), _mm256_mullo_epi16(g, _mm256_set1_epi16(kg)));
+	s = _mm256_add_epi16(s, _mm256_add_epi16(_mm256_mullo_epi16(b, _mm256_set1_epi16(kb)), _mm256_set1_epi16(128)));
+	s = _mm256_add_epi16(_mm256_srai_epi16(s, 8), _mm256_set1_epi16(128));
+	/* pack in-lane, then gather the low half of each lane */
+	s = _mm256_packus_epi16(s, s);
+	return _mm256_castsi256_si128(_mm256_permute4x64_epi64(s, 0x08));
+}
+template <int W>
+__attribute__((target("avx2")))
+static void to_yuv420p_rows_avx2(const uint8_t *src0, const uint8_t *src1, uint8_t *const *d0, uint8_t *const *d1, int runtime_width)
+{
+	uint8_t *y0 = d0[0], *y1 = d1[0], *u = d0[1], *v = d0[2];
+	const int width = W ? W : runtime_width;
+	const __m256i ones = _mm256_set1_epi8(1);
+	int x = 0;
+	KERNEL_UNROLL
+	for (; x + 32 <= width; x += 32) {
+		__m256i r0, g0, b0, r1, g1, b1;
+		load_rgb32(src0 + 3 * x, &r0, &g0, &b0);
+		load_rgb32(src1 + 3 * x, &r1, &g1, &b1);
+		_mm256_store_si256((__m256i *)(y0 + x), luma32_avx2(r0, g0, b0));
+		_mm256_store_si256((__m256i *)(y1 + x), luma32_avx2(r1, g1, b1));
+		__m256i rs = _mm256_add_epi16(_mm256_maddubs_epi16(r0, ones), _mm256_maddubs_epi16(r1, ones));
+		__m256i gs = _mm256_add_epi16(_mm256_maddubs_epi16(g0, ones), _mm256_maddubs_epi16(g1, ones));
+		__m256i bs = _mm256_add_epi16(_mm256_maddubs_epi16(b0, ones), _mm256_maddubs_epi16(b1, ones));
+		_mm_store_si128((__m128i *)(u + x / 2), chroma16_avx2(rs, gs, bs, -38, -74, 112));
+		_mm_store_si128((__m128i *)(v + x / 2), chroma16_avx2(rs, gs, bs, 112, -94, -18));
+	}
+	if (!W || W % 32) {
+		yuv420_pixels_c<false>(src0, src1, d0, d1, x, width);
+	}
+}
+
+template <int W>
+__attribute__((target("avx2")))
+static void pattern_yuv420p_avx2(const PatternLut *lut, int y, int frame_index, uint8_t *const *d0, uint8_t *const *d1)
+{
+	const int width = W ? W : lut->width;
+	const int y1 = y + 1 < lut->height ? y + 1 : y;
+	const uint8_t *blue = lut->blue + (frame_index & 127);
+	uint8_t *ya = d0[0], *yb = d1[0], *u = d0[1], *v = d0[2];
+	const __m256i ones = _mm256_set1_epi8(1);
+	const __m256i g0 = _mm256_set1_epi8((char)lut->row_ramp[y]);
+	const __m256i g1 = _mm256_set1_epi8((char)lut->row_ramp[y1]);
+	const __m256i inv0 = _mm256_set1_epi8(((y + frame_index) & 64) ? -1 : 0);
+	const __m256i inv1 = _mm256_set1_epi8(((y1 + frame_index) & 64) ? -1 : 0);
+	const __m256i gs = _mm256_set1_epi16(2 * (lut->row_ramp[y] + lut->row_ramp[y1]));
+	int x = 0;
+	KERNEL_UNROLL
+	for (; x + 32 <= width; x += 32) {
+		__m256i r = _mm256_load_si256((const __m256i *)(lut->col_ramp + x));
+		__m256i bl = _mm256_loadu_si256((const __m256i *)(blue + x));
+		__m256i b0 = _mm256_xor_si256(bl, inv0);
+		__m256i b1 = _mm256_xor_si256(bl, inv1);
+		_mm256_store_si256((__m256i *)(ya + x), luma32_avx2(r, g0, b0));
+		_mm256_store_si256((__m256i *)(yb + x), luma32_avx2(r, g1, b1));
+		__m256i rs = _mm256_maddubs_epi16(r, ones);
+		rs = _mm256_add_epi16(rs, rs);
+		__m256i bs = _mm256_add_epi16(_mm256_maddubs_epi16(b0, ones), _mm256_maddubs_epi16(b1, ones));
+		_mm_store_si128((__m128i *)(u + x / 2), chroma16_avx2(rs, gs, bs, -38, -74, 112));
+		_mm_store_si128((__m128i *)(v + x / 2), chroma16_avx2(rs, gs, bs, 112, -94, -18));
+	}
+	if (!W || W % 32) {
+		pattern_yuv420_pixels_c(lut, y, y1, frame_index, d0, d1, x, width);
+	}
+}
+
+/* sine_c() on eight phases */
+__attribute__((target("avx2")))
+static inline __m256i sine_avx2(__m256i u)
+{
+	__m256i sign = _mm256_srai_epi32(u, 31);
+	__m256i v = _mm256_and_si256(u, _mm256_set1_epi32(0x7fffffff));
+	v = _mm256_min_epu32(v, _mm256_sub_epi32(_mm256_set1_epi32(INT32_MIN), v));
+	__m256i x = _mm256_srli_epi32(v, 15);
+	__m256i x2 = _mm256_srli_epi32(_mm256_mullo_epi32(x, x), 15);
+	__m256i r = _mm256_set1_epi32(SINE_C7);
+	r = _mm256_add_epi32(_mm256_set1_epi32(SINE_C5), _mm256_srai_epi32(_mm256_mullo_epi32(r, x2), 15));
+	r = _mm256_add_epi32(_mm256_set1_epi32(SINE_C3), _mm256_srai_epi32(_mm256_mullo_epi32(r, x2), 15));
+	r = _mm256_add_epi32(_mm256_set1_epi32(SINE_C1), _mm256_srai_epi32(_mm256_mullo_epi32(r, x2), 15));
+	__m256i out = _mm256_srai_epi32(_mm256_mullo_epi32(r, x), 17);
+	return _mm256_sub_epi32(_mm256_xor_si256(out, sign), sign);
+}
+__attribute__((target("avx2")))
+static inline __m256i phase_hi_avx2(__m256i a, __m256i b)
+{
+	const __m256i odd = _mm256_setr_epi32(1, 3, 5, 7, 1, 3, 5, 7);
+	return _mm256_permute2x128_si256(_mm256_permutevar8x32_epi32(a, odd), _mm256_permutevar8x32_epi32(b, odd), 0x20);
+}
+__attribute__((target("avx2")))
+static void audio_synth_avx2(int16_t *dst, int n, uint64_t phase, uint64_t incr, uint64_t incr2)
+{
+	uint64_t phase_k[16], step_k[16];
+	audio_lanes(phase_k, step_k, 16, phase, incr, incr2);
+	__m256i p[4], st[4];
+	for (int i = 0; i < 4; i++) {
+		p[i] = _mm256_loadu_si256((const __m256i *)(phase_k + 4 * i));
+		st[i] = _mm256_loadu_si256((const __m256i *)(step_k + 4 * i));
+	}
+	const __m256i growth = _mm256_set1_epi64x((long long)(256 * incr2));
+	int j = 0;
+	for (; j + 16 <= n; j += 16) {
+		__m256i lo = sine_avx2(phase_hi_avx2(p[0], p[1]));
+		__m256i hi = sine_avx2(phase_hi_avx2(p[2], p[3]));
+		/* packs works within 128-bit lanes */
+		_mm256_storeu_si256((__m256i *)(dst + j), _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), _MM_SHUFFLE(3, 1, 2, 0)));
+		for (int i = 0; i < 4; i++) {
+			p[i] = _mm256_add_epi64(p[i], st[i]);
+			st[i] = _mm256_add_epi64(st[i], growth);
+		}
+	}
+	audio_tail(dst, j, n, phase, incr, incr2);
+}
+
+/**************************************************************/
+/* AVX-512 (F + BW) */
+
+/* The zero-masked forms with a full mask: GCC 12 fills the pass-through
+ * operand of the plain casts, extracts, permutes, 32-bit shifts and
+ * conversions with an uninitialized vector and warns about it
+ * (-Wuninitialized) where they are inlined. */
+#define extract128(v, i) _mm512_maskz_extracti32x4_epi32(0xf, v, i)
+
+template <int W>
+__attribute__((target("avx512f,avx512bw")))
+static void pattern_row_avx512(uint8_t *dst, const PatternLut *lut, int y, int frame_index)
+{
+	const int width = W ? W : lut->width;
+	const uint8_t *blue = lut->blue + (frame_index & 127);
+	const __m128i g = _mm_set1_epi8((char)lut->row_ramp[y]);
+	const __m512i inv = _mm512_set1_epi8(((y + frame_index) & 64) ? -1 : 0);
+	int x = 0;
+	KERNEL_UNROLL
+	for (; x + 64 <= width; x += 64) {
+		__m512i r = _mm512_load_si512((const void *)(lut->col_ramp + x));
+		__m512i b = _mm512_xor_si512(_mm512_loadu_si512((const void *)(blue + x)), inv);
+		store_rgb16(dst + 3 * x, extract128(r, 0), g, extract128(b, 0));
+		store_rgb16(dst + 3 * x + 48, extract128(r, 1), g, extract128(b, 1));
+		store_rgb16(dst + 3 * x + 96, extract128(r, 2), g, extract128(b, 2));
+		store_rgb16(dst + 3 * x + 144, extract128(r, 3), g, extract128(b, 3));
+	}
+	if (!W || W % 64) {
+		pattern_pixels_c(dst, lut, x, width, y, frame_index);
+	}
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline void load_rgb64(const uint8_t *src, __m512i *r, __m512i *g, __m512i *b)
+{
+	__m128i rk[4], gk[4], bk[4];
+	for (int k = 0; k < 4; k++) {
+		load_rgb16(src + 48 * k, &rk[k], &gk[k], &bk[k]);
+	}
+	*r = _mm512_inserti32x4(_mm512_inserti32x4(_mm512_inserti32x4(_mm512_castsi128_si512(rk[0]), rk[1], 1), rk[2], 2), rk[3], 3);
+	*g = _mm512_inserti32x4(_mm512_inserti32x4(_mm512_inserti32x4(_mm512_castsi128_si512(gk[0]), gk[1], 1), gk[2], 2), gk[3], 3);
+	*b = _mm512_inserti32x4(_mm512_inserti32x4(_mm512_inserti32x4(_mm512_castsi128_si512(bk[0]), bk[1], 1), bk[2], 2), bk[3], 3);
+}
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i luma32_avx512(__m512i r, __m512i g, __m512i b)
+{
+	__m512i s = _mm512_add_epi16(_mm512_mullo_epi16(r, _mm512_set1_epi16(66)), _mm512_mullo_epi16(g, _mm512_set1_epi16(129)));
+	s = _mm512_add_epi16(s, _mm512_add_epi16(_mm512_mullo_epi16(b, _mm512_set1_epi16(25)), _mm512_set1_epi16(128)));
+	return _mm512_srli_epi16(s, 8);
+}
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i luma64_avx512(__m512i r, __m512i g, __m512i b)
+{
+	const __m512i z = _mm512_setzero_si512();
+	__m512i lo = luma32_avx512(_mm512_unpacklo_epi8(r, z), _mm512_unpacklo_epi8(g, z), _mm512_unpacklo_epi8(b, z));
+	__m512i hi = luma32_avx512(_mm512_unpackhi_epi8(r, z), _mm512_unpackhi_epi8(g, z), _mm512_unpackhi_epi8(b, z));
+	return _mm512_add_epi8(_mm512_packus_epi16(lo, hi), _mm512_set1_epi8(16));
+}
+__attribute__((target("avx512f,avx512bw")))
+static inline __m256i chroma32_avx512(__m512i rs, __m512i gs, __m512i bs, int kr, int kg, int kb)
+{
+	const __m512i two = _mm512_set1_epi16(2);
+	__m512i r = _mm512_srli_epi16(_mm512_add_epi16(rs, two), 2);
+	__m512i g = _mm512_srli_epi16(_mm512_add_epi16(gs, two), 2);
+	__m512i b = _mm512_srli_epi16(_mm512_add_epi16(bs, two), 2);
+	__m512i s = _mm512_add_epi16(_mm512_mullo_epi16(r, _mm512_set1_epi16(kr)), _mm512_mullo_epi16(g, _mm512_set1_epi16(kg)));
+	s = _mm512_add_epi16(s, _mm512_add_epi16(_mm512_mullo_epi16(b, _mm512_set1_epi16(kb)), _mm512_set1_epi16(128)));
+	s = _mm512_add_epi16(_mm512_srai_epi16(s, 8), _mm512_set1_epi16(128));
+	s = _mm512_packus_epi16(s, s);
+	s = _mm512_maskz_permutexvar_epi64(0xff, _mm512_setr_epi64(0, 2, 4, 6, 0, 2, 4, 6), s);
+	return _mm512_maskz_extracti64x4_epi64(0xf, s, 0);
+}
+template <int W>
+__attribute__((target("avx512f,avx512bw")))
+static void to_yuv420p_rows_avx512(const uint8_t *src0, const uint8_t *src1, uint8_t *const *d0, uint8_t *const *d1, int runtime_width)
+{
+	uint8_t *y0 = d0[0], *y1 = d1[0], *u = d0[1], *v = d0[2];
+	const int width = W ? W : runtime_width;
+	const __m512i ones = _mm512_set1_epi8(1);
+	int x = 0;
+	KERNEL_UNROLL
+	for (; x + 64 <= width; x += 64) {
+		__m512i r0, g0, b0, r1, g1, b1;
+		load_rgb64(src0 + 3 * x, &r0, &g0, &b0);
+		load_rgb64(src1 + 3 * x, &r1, &g1, &b1);
+		_mm512_store_si512((void *)(y0 + x), luma64_avx512(r0, g0, b0));
+		_mm512_store_si512((void *)(y1 + x), luma64_avx512(r1, g1, b1));
+		__m512i rs = _mm512_add_epi16(_mm512_maddubs_epi16(r0, ones), _mm512_maddubs_epi16(r1, ones));
+		__m512i gs = _mm512_add_epi16(_mm512_maddubs_epi16(g0, ones), _mm512_maddubs_epi16(g1, ones));
+		__m512i bs = _mm512_add_epi16(_mm512_maddubs_epi16(b0, ones), _mm512_maddubs_epi16(b1, ones));
+		_mm256_store_si256((__m256i *)(u + x / 2), chroma32_avx512(rs, gs, bs, -38, -74, 112));
+		_mm256_store_si256((__m256i *)(v + x / 2), chroma32_avx512(rs, gs, bs, 112, -94, -18));
+	}
+	if (!W || W % 64) {
+		yuv420_pixels_c<false>(src0, src1, d0, d1, x, width);
+	}
+}
+template <int W>
+__attribute__((target("avx512f,avx512bw")))
+static void pattern_yuv420p_avx512(const PatternLut *lut, int y, int frame_index, uint8_t *const *d0, uint8_t *const *d1)
+{
+	const int width = W ? W : lut->width;
+	const int y1 = y + 1 < lut->height ? y + 1 : y;
+	const uint8_t *blue = lut->blue + (frame_index & 127);
+	uint8_t *ya = d0[0], *yb = d1[0], *u = d0[1], *v = d0[2];
+	const __m512i ones = _mm512_set1_epi8(1);
+	const __m512i g0 = _mm512_set1_epi8((char)lut->row_ramp[y]);
+	const __m512i g1 = _mm512_set1_epi8((char)lut->row_ramp[y1]);
+	const __m512i inv0 = _mm512_set1_epi8(((y + frame_index) & 64) ? -1 : 0);
+	const __m512i inv1 = _mm512_set1_epi8(((y1 + frame_index) & 64) ? -1 : 0);
+	const __m512i gs = _mm512_set1_epi16(2 * (lut->row_ramp[y] + lut->row_ramp[y1]));
+	int x = 0;
+	KERNEL_UNROLL
+	for (; x + 64 <= width; x += 64) {
+		__m512i r = _mm512_load_si512((const void *)(lut->col_ramp + x));
+		__m512i bl = _mm512_loadu_si512((const void *)(blue + x));
+		__m512i b0 = _mm512_xor_si512(bl, inv0);
+		__m512i b1 = _mm512_xor_si512(bl, inv1);
+		_mm512_store_si512((void *)(ya + x), luma64_avx512(r, g0, b0));
+		_mm512_store_si512((void *)(yb + x), luma64_avx512(r, g1, b1));
+		__m512i rs = _mm512_maddubs_epi16(r, ones);
+		rs = _mm512_add_epi16(rs, rs);
+		__m512i bs = _mm512_add_epi16(_mm512_maddubs_epi16(b0, ones), _mm512_maddubs_epi16(b1, ones));
+		_mm256_store_si256((__m256i *)(u + x / 2), chroma32_avx512(rs, gs, bs, -38, -74, 112));
+		_mm256_store_si256((__m256i *)(v + x / 2), chroma32_avx512(rs, gs, bs, 112, -94, -18));
+	}
+	if (!W || W % 64) {
+		pattern_yuv420_pixels_c(lut, y, y1, frame_index, d0, d1, x, width);
+	}
+}
+/* sine_c() on sixteen phases */
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i sine_avx512(__m512i u)
+{
+	__m512i sign = _mm512_maskz_srai_epi32(0xffff, u, 31);
+	__m512i v = _mm512_and_si512(u, _mm512_set1_epi32(0x7fffffff));
+	v = _mm512_maskz_min_epu32(0xffff, v, _mm512_sub_epi32(_mm512_set1_epi32(INT32_MIN), v));
+	__m512i x = _mm512_maskz_srli_epi32(0xffff, v, 15);
+	__m512i x2 = _mm512_maskz_srli_epi32(0xffff, _mm512_mullo_epi32(x, x), 15);
+	__m512i r = _mm512_set1_epi32(SINE_C7);
+	r = _mm512_add_epi32(_mm512_set1_epi32(SINE_C5), _mm512_maskz_srai_epi32(0xffff, _mm512_mullo_epi32(r, x2), 15));
+	r = _mm512_add_epi32(_mm512_set1_epi32(SINE_C3), _mm512_maskz_srai_epi32(0xffff, _mm512_mullo_epi32(r, x2), 15));
+	r = _mm512_add_epi32(_mm512_set1_epi32(SINE_C1), _mm512_maskz_srai_epi32(0xffff, _mm512_mullo_epi32(r, x2), 15));
+	__m512i out = _mm512_maskz_srai_epi32(0xffff, _mm512_mullo_epi32(r, x), 17);
+	return _mm512_sub_epi32(_mm512_xor_si512(out, sign), sign);
+}
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i phase_hi_avx512(__m512i a, __m512i b)
+{
+	const __m512i odd = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31);
+	return _mm512_permutex2var_epi32(a, odd, b);
+}
+__attribute__((target("avx512f,avx512bw")))
+static void audio_synth_avx512(int16_t *dst, int n, uint64_t phase, uint64_t incr, uint64_t incr2)
+{
+	uint64_t phase_k[32], step_k[32];
+	audio_lanes(phase_k, step_k, 32, phase, incr, incr2);
+	__m512i p[4], st[4];
+	for (int i = 0; i < 4; i++) {
+		p[i] = _mm512_loadu_si512((const void *)(phase_k + 8 * i));
+		st[i] = _mm512_loadu_si512((const void *)(step_k + 8 * i));
+	}
+	const __m512i growth = _mm512_set1_epi64((long long)(1024 * incr2));
+	int j = 0;
+	for (; j + 32 <= n; j += 32) {
+		_mm256_storeu_si256((__m256i *)(dst + j), _mm512_maskz_cvtepi32_epi16(0xffff, sine_avx512(phase_hi_avx512(p[0], p[1]))));
+		_mm256_storeu_si256((__m256i *)(dst + j + 16), _mm512_maskz_cvtepi32_epi16(0xffff, sine_avx512(phase_hi_avx512(p[2], p[3]))));
+		for (int i = 0; i < 4; i++) {
+			p[i] = _mm512_add_epi64(p[i], st[i]);
+			st[i] = _mm512_add_epi64(st[i], growth);
+		}
+	}
+	audio_tail(dst, j, n, phase, incr, incr2);
+}
+#endif
+
+/**************************************************************/
+/* pattern tables */
+
+static std::mutex pattern_lut_mutex;
+static PatternLut *pattern_luts;
+
+const PatternLut *pattern_lut_get(int width, int height)
+{
+	std::lock_guard<std::mutex> lock(pattern_lut_mutex);
+	for (PatternLut *lut = pattern_luts; lut; lut = lut->next) {
+		if (lut->width == width && lut->height == height) return lut;
+	}
+	PatternLut *lut = new PatternLut;
+	/* padded to whole 64 byte vectors */
+	size_t col_size = (width + 63) & ~63;
+	size_t blue_size = (width + 128 + 63) & ~63;
+	lut->width = width;
+	lut->height = height;
+	/* the tables in use are never freed */
+	lut->col_ramp = (uint8_t *)aligned_malloc(col_size, 64);
+	lut->row_ramp = (uint8_t *)aligned_malloc(height, 64);
+	lut->blue = (uint8_t *)aligned_malloc(blue_size, 64);
+	if (!lut->col_ramp || !lut->row_ramp || !lut->blue) {
+		aligned_free(lut->col_ramp);
+		aligned_free(lut->row_ramp);
+		aligned_free(lut->blue);
+		delete lut;
+		return nullptr;
+	}
+	for (size_t x = 0; x < col_size; x++) {
+		lut->col_ramp[x] = x < (size_t)width ? x * 255 / width : 0;
+	}
+	for (int y = 0; y < height; y++) {
+		lut->row_ramp[y] = y * 255 / height;
+	}
+	for (size_t k = 0; k < blue_size; k++) {
+		lut->blue[k] = (k & 64) ? 0 : 255;
+	}
+	lut->next = pattern_luts;
+	pattern_luts = lut;
+	return lut;
+}
+
+/**************************************************************/
+/* dispatch */
+
+/* Widths with their own instantiation: constant trip counts, divisions by
+ * a constant and, as they are multiples of 64, no tail loop at any level.
+ * Other widths use the W = 0 variants, which read the width at run time. */
+static const int specialized_widths[] = { 1280, 1920, 3840, 7680 };
+#define SPECIALIZED_COUNT (sizeof(specialized_widths) / sizeof(specialized_widths[0]))
+
+static Kernels generic_kernels;
+static Kernels specialized_kernels[SPECIALIZED_COUNT];
+
+template <int W>
+static void set_to_yuv_c(Kernels *k)
+{
+	k->to_yuv[KPIX_YUV420P] = to_yuv_rows_c<KPIX_YUV420P, W>;
+	k->to_yuv[KPIX_NV12] = to_yuv_rows_c<KPIX_NV12, W>;
+	k->to_yuv[KPIX_YUV422P] = to_yuv_rows_c<KPIX_YUV422P, W>;
+	k->to_yuv[KPIX_YUV444P] = to_yuv_rows_c<KPIX_YUV444P, W>;
+	k->to_yuv[KPIX_YUV420P10] = to_yuv_rows_c<KPIX_YUV420P10, W>;
+	k->to_yuv[KPIX_P010] = to_yuv_rows_c<KPIX_P010, W>;
+}
+#ifdef HAVE_X86_SIMD
+/* AVX2 and AVX-512 only have a 4:2:0 8 bit planar converter and take the
+ * other formats from here. */
+template <int W>
+static void set_to_yuv_sse41(Kernels *k)
+{
+	k->to_yuv[KPIX_YUV420P] = to_yuv_rows_sse41<KPIX_YUV420P, W>;
+	k->to_yuv[KPIX_NV12] = to_yuv_rows_sse41<KPIX_NV12, W>;
+	k->to_yuv[KPIX_YUV422P] = to_yuv_rows_sse41<KPIX_YUV422P, W>;
+	k->to_yuv[KPIX_YUV444P] = to_yuv_rows_sse41<KPIX_YUV444P, W>;
+	k->to_yuv[KPIX_YUV420P10] = to_yuv_rows_sse41<KPIX_YUV420P10, W>;
+	k->to_yuv[KPIX_P010] = to_yuv_rows_sse41<KPIX_P010, W>;
+}
+#endif
+
+template <int W>
+static CpuLevel set_kernels(Kernels *k, CpuLevel level)
+{
+	switch (level) {
+#ifdef HAVE_X86_SIMD
+	case CPU_AVX512:
+		k->pattern_row = pattern_row_avx512<W>;
+		k->pattern_yuv420p = pattern_yuv420p_avx512<W>;
+		set_to_yuv_sse41<W>(k);
+		k->to_yuv[KPIX_YUV420P] = to_yuv420p_rows_avx512<W>;
+		k->audio_synth = audio_synth_avx512;
+		return level;
+	case CPU_AVX2:
+		k->pattern_row = pattern_row_avx2<W>;
+		k->pattern_yuv420p = pattern_yuv420p_avx2<W>;
+		set_to_yuv_sse41<W>(k);
+		k->to_yuv[KPIX_YUV420P] = to_yuv420p_rows_avx2<W>;
+		k->audio_synth = audio_synth_avx2;
+		return level;
+	case CPU_SSE41:
+		k->pattern_row = pattern_row_sse41<W>;
+		k->pattern_yuv420p = pattern_yuv420p_sse41<W>;
+		set_to_yuv_sse41<W>(k);
+		k->audio_synth = audio_synth_sse41;
+		return level;
+#endif
+	default:
+		k->pattern_row = pattern_row_c<W>;
+		k->pattern_yuv420p = pattern_yuv420p_c<W>;
+		set_to_yuv_c<W>(k);
+		k->audio_synth = audio_synth_c;
+		return CPU_SCALAR;
+	}
+}
+
+CpuLevel kernels_init(CpuLevel level)
+{
+	CpuLevel max = cpu_detect();
+	if (level > max) level = max;
+	level = set_kernels<0>(&generic_kernels, level);
+	set_kernels<1280>(&specialized_kernels[0], level);
+	set_kernels<1920>(&specialized_kernels[1], level);
+	set_kernels<3840>(&specialized_kernels[2], level);
+	set_kernels<7680>(&specialized_kernels[3], level);
+	return level;
+}
+
+const Kernels *kernels_get(int width)
+{
+	for (size_t i = 0; i < SPECIALIZED_COUNT; i++) {
+		if (specialized_widths[i] == width) return &specialized_kernels[i];
+	}
+	return &generic_kernels;
+}
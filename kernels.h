@@ -0,0 +1,80 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu.h"
+
+/* Inner loops of the video generator and converter and of the audio tone
+ * generator, with one variant per CpuLevel and per common picture width.
+ * kernels_init() fills the tables once at startup; a job looks its table
+ * up with kernels_get() and goes through the function pointers. All
+ * variants produce identical output. Rows must be 16 byte aligned, as
+ * alloc_picture() guarantees. */
+/* Tables of the test pattern for one picture size, so that generating a
+ * pixel takes no division:
+ *   R = col_ramp[x]                       x * 255 / width
+ *   G = row_ramp[y]                       y * 255 / height
+ *   B = blue[x + (i & 127)] ^ (((y + i) & 64) ? 0xff : 0)
+ * where i is the frame index; blue[k] is (k & 64) ? 0 : 255, one XOR
+ * period (128) longer than the row. */
+struct PatternLut {
+	int width, height;
+	uint8_t *col_ramp;
+	uint8_t *row_ramp;
+	uint8_t *blue;
+	PatternLut *next;
+};
+
+/* Tables for width x height, built on first use and then shared by every
+ * session of that size for the rest of the process. Thread safe. Returns
+ * nullptr if out of memory. */
+const PatternLut *pattern_lut_get(int width, int height);
+
+/* Output formats of the converter. */
+enum KernelPixFmt {
+	KPIX_YUV420P,
+	KPIX_NV12,
+	KPIX_YUV422P,
+	KPIX_YUV444P,
+	KPIX_YUV420P10,	/* little endian, value in the low 10 bits */
+	KPIX_P010,	/* little endian, value in the high 10 bits */
+	KPIX_COUNT
+};
+
+struct Kernels {
+	/* One RGB24 row of the test pattern. */
+	void (*pattern_row)(uint8_t *dst, const PatternLut *lut, int y, int frame_index);
+	/* Two RGB24 rows to YUV (BT.601 limited range), indexed by
+	 * KernelPixFmt. row0[p] and row1[p] point at the rows of plane p
+	 * matching src0 and src1; vertically subsampled chroma is written
+	 * through row0 only. For an odd last row pass the same rows twice. */
+	void (*to_yuv[KPIX_COUNT])(const uint8_t *src0, const uint8_t *src1, uint8_t *const *row0, uint8_t *const *row1, int width);
+	/* Pattern rows y and y + 1 straight to YUV420P, without the RGB24
+	 * rows in between; same output as pattern_row followed by
+	 * to_yuv[KPIX_YUV420P]. For an odd last row pass the same rows
+	 * twice. */
+	void (*pattern_yuv420p)(const PatternLut *lut, int y, int frame_index, uint8_t *const *row0, uint8_t *const *row1);
+	/* n samples of the test tone, 16 bit mono, sin(phase) * 10000 to
+	 * within 1: sample j is at phase + j * incr + j * (j - 1) / 2 * incr2,
+	 * all in units of 2^-64 cycle and modulo 2^64 (see
+	 * audio_synth_advance). The same in the table of every width. */
+	void (*audio_synth)(int16_t *dst, int n, uint64_t phase, uint64_t incr, uint64_t incr2);
+};
+
+/* Move an audio_synth phase and increment on by j samples. */
+static inline void audio_synth_advance(uint64_t *phase, uint64_t *incr, uint64_t incr2, uint64_t j)
+{
+	*phase += j * *incr + j * (j - 1) / 2 * incr2;
+	*incr += j * incr2;
+}
+
+/* Select the variants for 'level', lowered to what this CPU supports.
+ * Returns the level actually in use. */
+CpuLevel kernels_init(CpuLevel level);
+/* Kernels for pictures 'width' pixels wide: compiled for that width if it
+ * is one of the common ones, generic otherwise. The width passed to the
+ * kernels (or held by the PatternLut) must then be the same value. */
+const Kernels *kernels_get(int width);
+
+#endif
@@ -35,70 +35,764 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
-#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 extern "C" {
 #include <libavutil/opt.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/mathematics.h>
 #include <libavutil/timestamp.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
 #include <libswresample/swresample.h>
+#include <libavutil/audio_fifo.h>
 }
+#include "alignedmem.h"
+#include "bench.h"
+#include "budget.h"
+#include "kernels.h"
+#include "manifest.h"
+#include "ringbuffer.h"
+#include "slicepool.h"
+#include "statslog.h"
 
-static int audio_is_eof, video_is_eof;
 #define STREAM_DURATION   5.0
 #define STREAM_FRAME_RATE 29.97
 #define STREAM_PIX_FMT    AV_PIX_FMT_RGB24
 static int sws_flags = SWS_BICUBIC;
 
-static int write_frame(AVFormatContext *fmt_ctx, const AVRational *time_base, AVStream *st, AVPacket *pkt)
+/* Selectable audio codecs. A bit_rate of 0 means the codec is lossless
+ * and the bitrate is left to the encoder. */
+struct AudioCodecEntry {
+	const char *name;
+	enum AVCodecID codec_id;
+	int bit_rate;
+};
+static const AudioCodecEntry audio_codecs[] = {
+	{ "mp3",  AV_CODEC_ID_MP3,       160000 },
+	{ "aac",  AV_CODEC_ID_AAC,       160000 },
+	{ "flac", AV_CODEC_ID_FLAC,      0 },
+	{ "pcm",  AV_CODEC_ID_PCM_S16LE, 0 },
+};
+static const AudioCodecEntry *audio_codec_entry = &audio_codecs[0];
+
+/* Sample rate conversion. The generator runs at src_rate; when it differs
+ * from the encoder rate, libswresample converts between them. Presets
+ * trade speed for quality, individual settings override the preset. */
+struct ResamplePreset {
+	const char *name;
+	int filter_size;
+	int phase_shift;
+	int linear_interp;
+	double cutoff;
+	int precision; /* soxr only, in bits */
+};
+static const ResamplePreset resample_presets[] = {
+	{ "fast",   8,  6, 1, 0.80, 16 },
+	{ "medium", 32, 10, 0, 0.97, 20 },
+	{ "high",   64, 12, 1, 0.98, 28 },
+};
+static struct {
+	int src_rate = 0; /* 0: same as the encoder */
+	const char *engine = "swr"; /* "swr" or "soxr" */
+	const ResamplePreset *preset = &resample_presets[1];
+	int filter_size = -1;
+	int precision = -1;
+} resample;
+
+/* Encoder input formats, produced from the RGB24 pattern by libswscale
+ * or by the internal kernels. */
+struct PixFmtEntry {
+	const char *name;
+	enum AVPixelFormat pix_fmt;
+	KernelPixFmt kernel;
+};
+static const PixFmtEntry pix_fmts[] = {
+	{ "yuv420p",   AV_PIX_FMT_YUV420P,     KPIX_YUV420P },
+	{ "nv12",      AV_PIX_FMT_NV12,        KPIX_NV12 },
+	{ "yuv422p",   AV_PIX_FMT_YUV422P,     KPIX_YUV422P },
+	{ "yuv444p",   AV_PIX_FMT_YUV444P,     KPIX_YUV444P },
+	{ "yuv420p10", AV_PIX_FMT_YUV420P10LE, KPIX_YUV420P10 },
+	{ "p010",      AV_PIX_FMT_P010LE,      KPIX_P010 },
+};
+static const PixFmtEntry *pix_fmt_entry = &pix_fmts[0];
+/* video encoder by name, nullptr for the default of the output format */
+static const char *video_codec_name;
+static int video_width = 1280, video_height = 720;
+/* Rows per tile when generating and converting a picture tile by tile;
+ * 0 disables tiling, -1 picks a height for pictures of 4K and above. */
+static int tile_rows = -1;
+/* Cache budget of one tile, RGB24 and converted rows together; about the
+ * L2 size of current cores. */
+#define TILE_CACHE_BYTES (256 * 1024)
+
+static bool pipeline_enabled;
+static int prefetch_workers; /* render workers, 0: generate and convert stages */
+/* How the RGB24 pattern becomes the encoder's picture: libswscale, the
+ * internal kernels, or the fused kernel that generates YUV420P directly */
+enum ConvertMode {
+	CONVERT_SWS,
+	CONVERT_NATIVE,
+	CONVERT_FUSED,
+};
+static ConvertMode convert_mode = CONVERT_SWS;
+static bool checkpoint_enabled, resume_enabled;
+static bool manifest_enabled;
+static bool stats_enabled;
+static bool low_latency;
+static bool slice_pool; /* slice jobs of all encoders on one shared pool */
+/* -frame-mem / -packet-mem in bytes, 0: unlimited */
+static int64_t frame_mem_limit, packet_mem_limit;
+static bool live_mode; /* drop video frames rather than wait for storage */
+/* -live drops frames once this much encoded data is waiting to be written,
+ * unless -packet-mem says otherwise: a few seconds at the default rate */
+#define LIVE_PACKET_MEM (8 << 20)
+static int max_retries;
+static double progress_interval = -1; /* seconds, 0: off, -1: 1 s on a terminal */
+
+/* av_err2str() relies on a compound literal, which C++ does not have. */
+static std::string err2str(int errnum)
+{
+	char buf[AV_ERROR_MAX_STRING_SIZE];
+	av_strerror(errnum, buf, sizeof(buf));
+	return buf;
+}
+
+/* State recorded after each completed GOP. Timestamps are in the output
+ * stream time bases. */
+struct Checkpoint {
+	int64_t frame;         /* first frame of the next GOP */
+	int64_t audio_samples; /* first audio sample not yet written */
+	int64_t video_pts;     /* last video packet written */
+	int64_t audio_pts;     /* last audio packet written */
+};
+#define MAX_STREAMS 4
+
+/* pipeline: generate -> convert -> encode -> mux on separate threads,
+ * connected by rings of preallocated frames and packets */
+#define PIPELINE_FRAMES  4
+#define PIPELINE_PACKETS 64
+#define MUX_BATCH        16 /* packets the mux thread takes at a time */
+/* With -prefetch the generate and convert threads are replaced by render
+ * workers, each rendering whole frames into its own small pool. */
+#define PREFETCH_MAX_WORKERS 16
+#define PREFETCH_FRAMES      2
+/* -low-latency: frames in flight between the encoder input and the muxer
+ * output that can be timed at once */
+#define LATENCY_SLOTS 64
+struct RenderWorker : CacheAligned {
+	SpscRing<AVFrame *, PREFETCH_FRAMES> free_ring, ready_ring;
+	AVFrame *pool[PREFETCH_FRAMES] = {};
+	AVFrame *rgb = nullptr; /* RGB24 scratch, whole picture or one tile */
+	struct SwsContext *sws_ctx = nullptr;
+	std::thread thread;
+};
+struct Pipeline : CacheAligned {
+	SpscRing<AVFrame *, 8> rgb_free_ring, rgb_ready_ring, yuv_free_ring, yuv_ready_ring;
+	SpscRing<AVPacket *, PIPELINE_PACKETS> pkt_free_ring, pkt_ready_ring;
+	AVFrame *rgb_pool[PIPELINE_FRAMES] = {}, *yuv_pool[PIPELINE_FRAMES] = {};
+	AVPacket *pkt_pool[PIPELINE_PACKETS] = {};
+	std::thread generate_thread, convert_thread, mux_thread;
+	RenderWorker *workers[PREFETCH_MAX_WORKERS] = {};
+	int nb_workers = 0;
+	int next_worker = 0; /* worker holding the next frame to encode */
+	std::atomic<int> error{0}; /* first error of a stage thread */
+};
+
+/* Everything needed to encode one output file. Sessions share nothing but
+ * the option globals above, so several can run side by side and a failed
+ * one can be dropped and retried without affecting the others. */
+struct Session {
+	const char *filename;
+	AVFormatContext *oc = nullptr;
+	AVStream *audio_st = nullptr, *video_st = nullptr;
+	const AVCodec *audio_codec = nullptr, *video_codec = nullptr;
+	AVCodecContext *audio_enc = nullptr, *video_enc = nullptr;
+	AVPacket *pkt = nullptr; /* encoder output, reused for every packet */
+	Manifest *manifest = nullptr; /* owns the output file when set */
+	StatsLog *stats = nullptr;
+	uint32_t stats_encode_ns[MAX_STREAMS] = {}; /* encoder time since the stream's last packet */
+	bool header_written = false;
+	int audio_is_eof = 0, video_is_eof = 0;
+	double audio_pts = 0, video_pts = 0;
+	/* audio output */
+	int64_t audio_src_pos = 0; /* next sample of the signal generator */
+	int audio_src_rate = 0;
+	AVFrame *audio_frame = nullptr;
+	uint8_t **src_samples_data = nullptr;
+	int       src_samples_linesize = 0;
+	int       src_nb_samples = 0;
+	enum AVSampleFormat src_sample_fmt = AV_SAMPLE_FMT_S16;
+	/* rate conversion output, queued until a full encoder frame is available */
+	uint8_t **rs_samples_data = nullptr;
+	int       rs_samples_linesize = 0;
+	int       rs_max_nb_samples = 0;
+	AVAudioFifo *audio_fifo = nullptr;
+	int audio_fifo_drained = 0;
+	int samples_count = 0;
+	struct SwrContext *swr_ctx = nullptr;
+	/* PCM S16LE passthrough: the generator writes straight into pooled packet
+	 * buffers which are handed to the muxer without an encoder call. */
+	AVBufferPool *audio_pkt_pool = nullptr;
+	int audio_pkt_size = 0;
+	/* video output */
+	AVFrame *frame = nullptr;     /* encoder input */
+	AVFrame *tmp_frame = nullptr; /* RGB24 pattern, converted into frame */
+	int tile_rows = 0; /* tmp_frame holds one tile of this many rows, 0: whole pictures */
+	bool fused = false; /* pattern generated straight into frame, no tmp_frame */
+	int frame_count = 0;
+	struct SwsContext *sws_ctx = nullptr;
+	Pipeline *pipe = nullptr;
+	const Kernels *kernels = nullptr; /* chosen for the picture width */
+	const PatternLut *pattern = nullptr;
+	int chroma_shift = 0; /* log2 of the vertical chroma subsampling */
+	/* checkpoint and resume */
+	std::string checkpoint_path;
+	bool checkpoint_armed = false;
+	bool resume = false;
+	int gop_size = 1;
+	int video_index = -1, audio_index = -1;
+	int audio_sample_rate = 0;
+	/* last packet handed to the muxer, per stream */
+	int64_t mux_last_pts[MAX_STREAMS];
+	int64_t mux_last_end[MAX_STREAMS];
+	/* packets at or before these timestamps were copied from the interrupted
+	 * output and must not be written again */
+	int64_t resume_floor[MAX_STREAMS];
+	/* -low-latency: when each video frame was sent to the encoder, by pts
+	 * modulo LATENCY_SLOTS (0: free), and the measured delays until its
+	 * packet was written */
+	std::atomic<uint64_t> push_ns[LATENCY_SLOTS];
+	std::vector<uint32_t> latency_us;
+	/* memory in flight: every picture the session allocates, and encoded
+	 * packets from the encoder until the muxer has written them */
+	ByteBudget frame_budget, packet_budget;
+	int dropped_frames = 0;
+	/* -memprof: packet bytes inside the muxer's interleaving queue */
+	int64_t mux_queued = 0, mux_queued_peak = 0;
+	/* progress, stored by the encode and mux threads with plain relaxed
+	 * stores and read by the monitor thread */
+	std::atomic<int> progress_frames{0}; /* encoded and dropped */
+	std::atomic<int> progress_dropped{0};
+	std::atomic<int64_t> progress_media_us{0};
+	std::atomic<int64_t> progress_bytes{0};
+	std::chrono::steady_clock::time_point start_time;
+
+	Session(const char *filename)
+		: filename(filename)
+		, checkpoint_path(std::string(filename) + ".ckpt")
+		, frame_budget(frame_mem_limit)
+		, packet_budget(packet_mem_limit)
+	{
+		for (int i = 0; i < MAX_STREAMS; i++) {
+			mux_last_pts[i] = AV_NOPTS_VALUE;
+			mux_last_end[i] = 0;
+			resume_floor[i] = INT64_MIN;
+		}
+		for (int i = 0; i < LATENCY_SLOTS; i++) {
+			push_ns[i] = 0;
+		}
+	}
+};
+
+/**************************************************************/
+/* cancellation, checkpoint and resume */
+static volatile sig_atomic_t cancel_requested;
+static void on_cancel_signal(int sig)
+{
+	cancel_requested = 1;
+	/* a second signal terminates immediately */
+	signal(sig, SIG_DFL);
+}
+
+static int save_checkpoint(Session *s, int64_t next_frame)
+{
+	AVFormatContext *oc = s->oc;
+	Checkpoint ck = {};
+	/* everything recorded must be on disk first */
+	av_interleaved_write_frame(oc, nullptr);
+	avio_flush(oc->pb);
+	ck.frame = next_frame;
+	if (s->video_index >= 0) {
+		ck.video_pts = s->mux_last_pts[s->video_index];
+	}
+	if (s->audio_index >= 0) {
+		AVRational rate = {1, s->audio_sample_rate};
+		ck.audio_pts = s->mux_last_pts[s->audio_index];
+		ck.audio_samples = av_rescale_q(s->mux_last_end[s->audio_index], oc->streams[s->audio_index]->time_base, rate);
+	}
+	std::string tmp = s->checkpoint_path + ".tmp";
+	FILE *fp = fopen(tmp.c_str(), "w");
+	if (!fp) return AVERROR(errno);
+	fprintf(fp, "gop %lld\n", (long long)(next_frame / s->gop_size));
+	fprintf(fp, "frame %lld\n", (long long)ck.frame);
+	fprintf(fp, "audio_samples %lld\n", (long long)ck.audio_samples);
+	fprintf(fp, "video_pts %lld\n", (long long)ck.video_pts);
+	fprintf(fp, "audio_pts %lld\n", (long long)ck.audio_pts);
+	fflush(fp);
+#ifndef _WIN32
+	fsync(fileno(fp));
+#endif
+	fclose(fp);
+#ifdef _WIN32
+	remove(s->checkpoint_path.c_str());
+#endif
+	return rename(tmp.c_str(), s->checkpoint_path.c_str()) == 0 ? 0 : AVERROR(errno);
+}
+static int load_checkpoint(Session *s, Checkpoint *ck)
+{
+	char key[32];
+	long long value;
+	int n = 0;
+	FILE *fp = fopen(s->checkpoint_path.c_str(), "r");
+	if (!fp) return AVERROR(errno);
+	*ck = Checkpoint();
+	while (fscanf(fp, "%31s %lld", key, &value) == 2) {
+		if (strcmp(key, "frame") == 0) ck->frame = value, n++;
+		else if (strcmp(key, "audio_samples") == 0) ck->audio_samples = value, n++;
+		else if (strcmp(key, "video_pts") == 0) ck->video_pts = value, n++;
+		else if (strcmp(key, "audio_pts") == 0) ck->audio_pts = value, n++;
+	}
+	fclose(fp);
+	return n == 4 ? 0 : AVERROR_INVALIDDATA;
+}
+static uint64_t latency_clock()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+static bool file_exists(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp) return false;
+	fclose(fp);
+	return true;
+}
+
+/* Follow a packet through libavformat by handing it over with a buffer
+ * reference of its own, released with the last reference to the packet
+ * data: in our queue, in the muxer's interleaving queue or wherever else
+ * libavformat keeps it. Used for the packet budget charge and, with
+ * -memprof, to measure the interleaving queue. */
+struct HeldPacket {
+	AVBufferRef *buf;
+	ByteBudget *budget;
+	int64_t *queued;
+	int size;
+};
+static void release_held_packet(void *opaque, uint8_t *data)
+{
+	HeldPacket *h = (HeldPacket *)opaque;
+	(void)data;
+	if (h->budget) h->budget->release(h->size);
+	if (h->queued) *h->queued -= h->size;
+	av_buffer_unref(&h->buf);
+	delete h;
+}
+/* On failure the packet is left as it was and nothing is released. */
+static int hold_packet(AVPacket *pkt, ByteBudget *budget, int64_t *queued)
+{
+	int ret = av_packet_make_refcounted(pkt);
+	if (ret < 0) return ret;
+	HeldPacket *h = new HeldPacket;
+	h->buf = pkt->buf;
+	h->budget = budget;
+	h->queued = queued;
+	h->size = pkt->size;
+	AVBufferRef *ref = av_buffer_create(pkt->buf->data, pkt->buf->size, release_held_packet, h, AV_BUFFER_FLAG_READONLY);
+	if (!ref) {
+		delete h;
+		return AVERROR(ENOMEM);
+	}
+	pkt->buf = ref;
+	if (queued) *queued += h->size;
+	return 0;
+}
+/* Final step of every packet: resume bookkeeping, checkpoints at GOP
+ * starts, then the interleaver. Runs on the mux thread in pipeline mode. */
+static int mux_packet(Session *s, AVPacket *pkt)
+{
+	AVFormatContext *fmt_ctx = s->oc;
+	int i = pkt->stream_index;
+	int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+	if (ts != AV_NOPTS_VALUE && ts <= s->resume_floor[i]) {
+		/* e.g. encoder priming output overlapping the copied part */
+		av_packet_unref(pkt);
+		return 0;
+	}
+	if (s->checkpoint_armed && i == s->video_index && (pkt->flags & AV_PKT_FLAG_KEY) && s->mux_last_pts[i] != AV_NOPTS_VALUE) {
+		/* the previous GOP is complete */
+		int ret = save_checkpoint(s, av_rescale_q(pkt->pts, fmt_ctx->streams[i]->time_base, s->video_enc->time_base));
+		if (ret < 0) {
+			fprintf(stderr, "%s: Could not write checkpoint: %s\n", s->filename, err2str(ret).c_str());
+		}
+	}
+	s->mux_last_pts[i] = pkt->pts;
+	s->mux_last_end[i] = pkt->pts + pkt->duration;
+	/* single writer, no read-modify-write needed */
+	s->progress_bytes.store(s->progress_bytes.load(std::memory_order_relaxed) + pkt->size, std::memory_order_relaxed);
+	if (s->manifest) {
+		int ret = manifest_add_packet(s->manifest, pkt);
+		if (ret < 0) {
+			av_packet_unref(pkt);
+			return ret;
+		}
+	}
+	if (!low_latency) {
+		if (!memprof_enabled) return av_interleaved_write_frame(fmt_ctx, pkt);
+		int ret = hold_packet(pkt, nullptr, &s->mux_queued);
+		if (ret < 0) {
+			av_packet_unref(pkt);
+			return ret;
+		}
+		ret = av_interleaved_write_frame(fmt_ctx, pkt);
+		s->mux_queued_peak = FFMAX(s->mux_queued_peak, s->mux_queued);
+		return ret;
+	}
+	/* The encode loop already interleaves by time; the muxer's interleaver
+	 * would hold each packet back until the other stream catches up. */
+	int64_t frame = i == s->video_index ? av_rescale_q(pkt->pts, fmt_ctx->streams[i]->time_base, s->video_enc->time_base) : -1;
+	int ret = av_write_frame(fmt_ctx, pkt);
+	av_packet_unref(pkt);
+	if (ret >= 0 && frame >= 0) {
+		uint64_t pushed = s->push_ns[frame % LATENCY_SLOTS].exchange(0);
+		if (pushed) s->latency_us.push_back((uint32_t)((latency_clock() - pushed) / 1000));
+	}
+	return ret;
+}
+/* Copy the packets covered by the checkpoint from the interrupted output,
+ * so that encoding continues from there instead of from zero. */
+static int copy_checkpointed_packets(Session *s, const char *path, const Checkpoint *ck)
+{
+	AVFormatContext *oc = s->oc;
+	AVFormatContext *ic = nullptr;
+	AVPacket *pkt = s->pkt;
+	int ret = avformat_open_input(&ic, path, nullptr, nullptr);
+	if (ret < 0) return ret;
+	if (ic->nb_streams != oc->nb_streams) {
+		avformat_close_input(&ic);
+		return AVERROR_INVALIDDATA;
+	}
+	while ((ret = av_read_frame(ic, pkt)) >= 0) {
+		int i = pkt->stream_index;
+		av_packet_rescale_ts(pkt, ic->streams[i]->time_base, oc->streams[i]->time_base);
+		int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+		int64_t limit = i == s->video_index ? ck->video_pts : ck->audio_pts;
+		if (ts == AV_NOPTS_VALUE || ts > limit) {
+			av_packet_unref(pkt);
+			continue;
+		}
+		ret = mux_packet(s, pkt);
+		if (ret < 0) break;
+		s->resume_floor[i] = ts;
+	}
+	avformat_close_input(&ic);
+	return ret == AVERROR_EOF ? 0 : ret;
+}
+
+/**************************************************************/
+/* progress */
+/* The monitor thread wakes up every progress_interval seconds and prints
+ * a line per session from counters the encode loop stores anyway, so
+ * monitoring adds no syscalls or locks to the loop. Sessions register once
+ * their header is written and leave in close_session(). */
+static std::mutex progress_lock;
+static std::condition_variable progress_wake;
+static std::vector<Session *> progress_sessions;
+static bool progress_stop;
+
+static void progress_add(Session *s)
+{
+	s->start_time = std::chrono::steady_clock::now();
+	std::lock_guard<std::mutex> lock(progress_lock);
+	progress_sessions.push_back(s);
+}
+static void progress_remove(Session *s)
+{
+	std::lock_guard<std::mutex> lock(progress_lock);
+	progress_sessions.erase(std::remove(progress_sessions.begin(), progress_sessions.end(), s), progress_sessions.end());
+}
+static void print_progress(Session *s, std::chrono::steady_clock::time_point now)
+{
+	double elapsed = std::chrono::duration<double>(now - s->start_time).count();
+	int frames = s->progress_frames.load(std::memory_order_relaxed);
+	double media = s->progress_media_us.load(std::memory_order_relaxed) / 1e6;
+	int64_t bytes = s->progress_bytes.load(std::memory_order_relaxed);
+	int dropped = s->progress_dropped.load(std::memory_order_relaxed);
+	char eta[32] = "-", drops[32] = "";
+	if (media > 0 && elapsed > 0) {
+		int left = (int)(FFMAX(STREAM_DURATION - media, 0.0) * elapsed / media + 0.5);
+		snprintf(eta, sizeof(eta), "%d:%02d:%02d", left / 3600, left / 60 % 60, left % 60);
+	}
+	if (dropped) snprintf(drops, sizeof(drops), " (%d dropped)", dropped);
+	fprintf(stderr, "%s: frame %d%s, %.2f/%.2f s (%.0f%%), %.1f fps, %.0f kb/s, ETA %s\n", s->filename, frames, drops, media, STREAM_DURATION, media * 100 / STREAM_DURATION,
+		elapsed > 0 ? frames / elapsed : 0.0, media > 0 ? bytes * 8 / media / 1000 : 0.0, eta);
+}
+static void progress_monitor()
+{
+#ifdef __linux__
+	/* nice only this thread */
+	setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+#endif
+	auto interval = std::chrono::duration<double>(progress_interval);
+	std::unique_lock<std::mutex> lock(progress_lock);
+	auto next = std::chrono::steady_clock::now();
+	while (!progress_stop) {
+		next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval);
+		progress_wake.wait_until(lock, next, [] { return progress_stop; });
+		if (progress_stop) break;
+		auto now = std::chrono::steady_clock::now();
+		for (Session *s : progress_sessions) {
+			print_progress(s, now);
+		}
+	}
+}
+
+/**************************************************************/
+/* pipeline stages */
+/* Record the first error of a stage thread and wake everybody up. */
+static void pipeline_fail(Session *s, int err)
+{
+	Pipeline *pipe = s->pipe;
+	int expected = 0;
+	pipe->error.compare_exchange_strong(expected, err);
+	s->frame_budget.close();
+	s->packet_budget.close();
+	pipe->rgb_free_ring.close();
+	pipe->rgb_ready_ring.close();
+	pipe->yuv_free_ring.close();
+	pipe->yuv_ready_ring.close();
+	for (int i = 0; i < pipe->nb_workers; i++) {
+		pipe->workers[i]->free_ring.close();
+		pipe->workers[i]->ready_ring.close();
+	}
+}
+/* Next packets for the muxer, as many as are queued up to max. While none
+ * is queued the encoder may go over the packet budget: what is charged
+ * then is held by the interleaver, which lets go of it only as it is
+ * given more. */
+static unsigned pop_packets(Session *s, AVPacket **pkts, unsigned max)
+{
+	SpscRing<AVPacket *, PIPELINE_PACKETS> *ring = &s->pipe->pkt_ready_ring;
+	unsigned n = ring->try_pop_n(pkts, max);
+	if (n) return n;
+	s->packet_budget.set_consumer_idle(true);
+	n = ring->pop_n(pkts, max);
+	s->packet_budget.set_consumer_idle(false);
+	return n;
+}
+/* Packets are taken and given back in batches, so that a burst of them
+ * (an audio frame after a large video packet, the flush at the end)
+ * costs one ring update and wakeup each way. */
+static void mux_stage(Session *s)
+{
+	Pipeline *pipe = s->pipe;
+	AVPacket *pkts[MUX_BATCH];
+	unsigned n;
+	while ((n = pop_packets(s, pkts, MUX_BATCH)) > 0) {
+		for (unsigned i = 0; i < n; i++) {
+			if (pipe->error == 0) {
+				uint64_t t0 = bench_begin(BENCH_MUX);
+				int ret = mux_packet(s, pkts[i]);
+				bench_end(BENCH_MUX, t0);
+				if (ret < 0) {
+					pipeline_fail(s, ret);
+				}
+			}
+			av_packet_unref(pkts[i]);
+		}
+		pipe->pkt_free_ring.push_n(pkts, n);
+	}
+}
+/* Hand a packet over to the mux thread. */
+static int queue_packet(Pipeline *pipe, AVPacket *pkt)
+{
+	AVPacket *slot;
+	int ret = pipe->error;
+	if (ret < 0) return ret;
+	if (!pipe->pkt_free_ring.pop(&slot)) return AVERROR_EOF;
+	av_packet_move_ref(slot, pkt);
+	pipe->pkt_ready_ring.push(slot);
+	return 0;
+}
+
+static int write_frame(Session *s, const AVRational *time_base, AVStream *st, AVPacket *pkt)
 {
 	/* rescale output packet timestamp values from codec to stream timebase */
 	pkt->pts = av_rescale_q_rnd(pkt->pts, *time_base, st->time_base, (AVRounding)(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
 	pkt->dts = av_rescale_q_rnd(pkt->dts, *time_base, st->time_base, (AVRounding)(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
 	pkt->duration = av_rescale_q(pkt->duration, *time_base, st->time_base);
 	pkt->stream_index = st->index;
-	return av_interleaved_write_frame(fmt_ctx, pkt);
+	if (s->stats) {
+		StatsRecord r = {};
+		r.pts = pkt->pts;
+		r.dts = pkt->dts;
+		r.size = pkt->size;
+		r.encode_ns = s->stats_encode_ns[st->index];
+		r.stream = st->index;
+		r.flags = (pkt->flags & AV_PKT_FLAG_KEY) ? STATSLOG_KEY : 0;
+		statslog_add(s->stats, &r);
+		s->stats_encode_ns[st->index] = 0;
+	}
+	/* Wait for the muxer to write enough of what is in flight, unless
+	 * live, where the packet is taken anyway and the next video frames are
+	 * dropped instead (see write_video_frame). The charge stays with the
+	 * packet data until libavformat is done with it. */
+	int size = pkt->size;
+	if (live_mode) {
+		s->packet_budget.force(size);
+	} else if (!s->packet_budget.acquire(size)) {
+		av_packet_unref(pkt);
+		return AVERROR_EXIT;
+	}
+	int ret = hold_packet(pkt, &s->packet_budget, nullptr);
+	if (ret < 0) {
+		s->packet_budget.release(size);
+		av_packet_unref(pkt);
+		return ret;
+	}
+	if (s->pipe) {
+		ret = queue_packet(s->pipe, pkt);
+		if (ret < 0) av_packet_unref(pkt);
+		return ret;
+	}
+	uint64_t t0 = bench_begin(BENCH_MUX);
+	ret = mux_packet(s, pkt);
+	bench_end(BENCH_MUX, t0);
+	return ret;
+}
+/* Send a frame to the encoder (nullptr to flush it) and write out every
+ * packet it has ready. Returns 1 once the encoder is fully drained. */
+static int encode_frame(Session *s, AVCodecContext *c, AVStream *st, AVFrame *frame, BenchStage stage)
+{
+	uint64_t t0 = bench_begin(stage);
+	uint64_t s0 = s->stats ? latency_clock() : 0;
+	int ret = avcodec_send_frame(c, frame);
+	if (s->stats) s->stats_encode_ns[st->index] += (uint32_t)(latency_clock() - s0);
+	bench_end(stage, t0);
+	if (ret == AVERROR_EOF && !frame) {
+		/* already flushed, only drain what is left */
+		ret = 0;
+	}
+	if (ret < 0) {
+		fprintf(stderr, "%s: Error sending a frame to the encoder: %s\n", s->filename, err2str(ret).c_str());
+		return ret;
+	}
+	while (1) {
+		t0 = bench_begin(stage);
+		s0 = s->stats ? latency_clock() : 0;
+		ret = avcodec_receive_packet(c, s->pkt);
+		if (s->stats) s->stats_encode_ns[st->index] += (uint32_t)(latency_clock() - s0);
+		bench_end(stage, t0);
+		if (ret == AVERROR(EAGAIN)) return 0;
+		if (ret == AVERROR_EOF) return 1;
+		if (ret < 0) {
+			fprintf(stderr, "%s: Error encoding frame: %s\n", s->filename, err2str(ret).c_str());
+			return ret;
+		}
+		ret = write_frame(s, &c->time_base, st, s->pkt);
+		if (ret < 0) {
+			fprintf(stderr, "%s: Error while writing packet: %s\n", s->filename, err2str(ret).c_str());
+			return ret;
+		}
+	}
+}
+/* Pick the encoder sample format. 16 bit formats are preferred because the
+ * signal generator can write them directly into the encoder's frame, so
+ * no resampler is needed. */
+static enum AVSampleFormat select_sample_fmt(const AVCodec *codec)
+{
+	const enum AVSampleFormat *p = codec->sample_fmts;
+	if (!p) return AV_SAMPLE_FMT_S16;
+	for (; *p != AV_SAMPLE_FMT_NONE; p++) {
+		if (*p == AV_SAMPLE_FMT_S16) return *p;
+	}
+	for (p = codec->sample_fmts; *p != AV_SAMPLE_FMT_NONE; p++) {
+		if (*p == AV_SAMPLE_FMT_S16P) return *p;
+	}
+	return codec->sample_fmts[0];
 }
-/* Add an output stream. */
-static AVStream *add_stream(AVFormatContext *oc, AVCodec **codec, enum AVCodecID codec_id)
+/* Add an output stream and allocate its encoder context. */
+static int add_stream(Session *s, AVStream **pst, AVCodecContext **pc, const AVCodec **codec, enum AVCodecID codec_id, const char *codec_name)
 {
+	AVFormatContext *oc = s->oc;
 	AVCodecContext *c;
 	AVStream *st;
 	/* find the encoder */
-	*codec = avcodec_find_encoder(codec_id);
-	if (!(*codec)) {
-		fprintf(stderr, "Could not find encoder for '%s'\n", avcodec_get_name(codec_id));
-		exit(1);
+	if (codec_name) {
+		*codec = avcodec_find_encoder_by_name(codec_name);
+		if (!(*codec)) {
+			fprintf(stderr, "%s: Could not find encoder '%s'\n", s->filename, codec_name);
+			return AVERROR_ENCODER_NOT_FOUND;
+		}
+		codec_id = (*codec)->id;
+	} else {
+		*codec = avcodec_find_encoder(codec_id);
+		if (!(*codec)) {
+			fprintf(stderr, "%s: Could not find encoder for '%s'\n", s->filename, avcodec_get_name(codec_id));
+			return AVERROR_ENCODER_NOT_FOUND;
+		}
 	}
-	st = avformat_new_stream(oc, *codec);
+	st = avformat_new_stream(oc, nullptr);
 	if (!st) {
-		fprintf(stderr, "Could not allocate stream\n");
-		exit(1);
+		fprintf(stderr, "%s: Could not allocate stream\n", s->filename);
+		return AVERROR(ENOMEM);
 	}
 	st->id = oc->nb_streams - 1;
-	c = st->codec;
+	*pst = st;
+	c = *pc = avcodec_alloc_context3(*codec);
+	if (!c) {
+		fprintf(stderr, "%s: Could not allocate an encoding context\n", s->filename);
+		return AVERROR(ENOMEM);
+	}
 	switch ((*codec)->type) {
 	case AVMEDIA_TYPE_AUDIO:
-		c->sample_fmt  = (*codec)->sample_fmts ? (*codec)->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
-		c->bit_rate    = 160000;
+		c->sample_fmt  = select_sample_fmt(*codec);
+		c->bit_rate    = audio_codec_entry->bit_rate;
 		c->sample_rate = 48000;
-		c->channels    = 2;
+		av_channel_layout_default(&c->ch_layout, 2);
+		c->time_base.num = 1;
+		c->time_base.den = c->sample_rate;
+		st->time_base = c->time_base;
 		break;
 	case AVMEDIA_TYPE_VIDEO:
 		c->codec_id = codec_id;
 		c->bit_rate = 8000000;
 		/* Resolution must be a multiple of two. */
-		c->width    = 1280;
-		c->height   = 720;
+		c->width    = video_width;
+		c->height   = video_height;
 		/* timebase: This is the fundamental unit of time (in seconds) in terms
 		 * of which frame timestamps are represented. For fixed-fps content,
 		 * timebase should be 1/framerate and timestamp increments should be
 		 * identical to 1. */
 		c->time_base.den = STREAM_FRAME_RATE * 100;
 		c->time_base.num = 100;
+		st->time_base = c->time_base;
 		c->gop_size      = 12; /* emit one intra frame every twelve frames at most */
-		c->pix_fmt       = AV_PIX_FMT_YUV420P;//STREAM_PIX_FMT;
+		c->pix_fmt       = pix_fmt_entry->pix_fmt;
+		if ((*codec)->pix_fmts) {
+			const enum AVPixelFormat *p = (*codec)->pix_fmts;
+			while (*p != AV_PIX_FMT_NONE && *p != c->pix_fmt) p++;
+			if (*p == AV_PIX_FMT_NONE) {
+				fprintf(stderr, "%s: Encoder '%s' does not support %s\n", s->filename, (*codec)->name, pix_fmt_entry->name);
+				return AVERROR(EINVAL);
+			}
+		}
 		if (c->codec_id == AV_CODEC_ID_MPEG2VIDEO) {
 			/* just for testing, we also add B frames */
 			c->max_b_frames = 2;
@@ -109,235 +803,564 @@ static AVStream *add_stream(AVFormatContext *oc, AVCodec **codec, enum AVCodecID
 			 * the motion of the chroma plane does not match the luma plane. */
 			c->mb_decision = 2;
 		}
+		if (low_latency) {
+			/* Every frame out as soon as it is in: no reordering, no
+			 * lookahead, and slice threads instead of frame threads, which
+			 * each hold a frame back. thread_count defaults to 1, which
+			 * would leave slice threading off; 0 is one per core. The
+			 * private options exist only in some encoders (x264, x265);
+			 * elsewhere they are ignored. */
+			c->max_b_frames = 0;
+			c->thread_type = FF_THREAD_SLICE;
+			c->thread_count = 0;
+			c->flags |= AV_CODEC_FLAG_LOW_DELAY;
+			av_opt_set(c->priv_data, "tune", "zerolatency", 0);
+			av_opt_set_int(c->priv_data, "rc-lookahead", 0, 0);
+		}
+		if (slice_pool && ((*codec)->capabilities & AV_CODEC_CAP_SLICE_THREADS)) {
+			/* As many slices as the shared pool has workers, run on it;
+			 * no threads of libavcodec's own (see slicepool.h). */
+			c->thread_count = 1;
+			c->slices = slicepool_size();
+			c->execute = slicepool_execute;
+			c->execute2 = slicepool_execute2;
+		}
 		break;
 	default:
 		break;
 	}
 	/* Some formats want stream headers to be separate. */
-//	if (oc->oformat->flags & AVFMT_GLOBALHEADER) {
-//		c->flags |= CODEC_FLAG_GLOBAL_HEADER;
-//	}
-	return st;
+	if (oc->oformat->flags & AVFMT_GLOBALHEADER) {
+		c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+	}
+	return 0;
 }
 /**************************************************************/
 /* audio output */
-static float t, tincr, tincr2;
-AVFrame *audio_frame;
-static uint8_t **src_samples_data;
-static int       src_samples_linesize;
-static int       src_nb_samples;
-static int max_dst_nb_samples;
-uint8_t **dst_samples_data;
-int       dst_samples_linesize;
-int       dst_samples_size;
-int samples_count;
-struct SwrContext *swr_ctx = nullptr;
-
-double audio_pts = 0, video_pts = 0;
 
+/* a * b mod m, for m below 2^62 */
+static uint64_t mulmod(uint64_t a, uint64_t b, uint64_t m)
+{
+	uint64_t r = 0;
+	a %= m;
+	b %= m;
+	while (b) {
+		if (b & 1) r = (r + a) % m;
+		a = (a * 2) % m;
+		b >>= 1;
+	}
+	return r;
+}
+/* num / den of a cycle in the audio_synth phase unit, 2^-64 cycle, for
+ * num < den < 2^62. */
+static uint64_t cycle_fraction(uint64_t num, uint64_t den)
+{
+	uint64_t q = 0;
+	for (int i = 0; i < 64; i++) {
+		num <<= 1;
+		q <<= 1;
+		if (num >= den) {
+			num -= den;
+			q |= 1;
+		}
+	}
+	return q;
+}
+/* Phase of the generator at sample n, with the step to the next sample
+ * and the growth of that step, in 2^-64 cycle. The tone starts at 110 Hz
+ * and rises by 110 Hz per second, so at rate R it has turned
+ *   110 n / R + 55 n (n - 1) / R^2 = (220 R n + 110 n (n - 1)) / (2 R^2)
+ * cycles, and steps by 110 (R + n) / R^2 cycles. Only the fraction
+ * matters; taking the numerators modulo the denominator in integers
+ * keeps them exact however long the stream runs. */
+static void audio_phase(int64_t n, int rate, uint64_t *phase, uint64_t *incr, uint64_t *incr2)
+{
+	uint64_t r2 = (uint64_t)rate * rate;
+	uint64_t m = 2 * r2;
+	uint64_t a = mulmod(220 * (uint64_t)rate, n, m);
+	uint64_t b = n > 0 ? mulmod(mulmod(n, n - 1, m), 110, m) : 0;
+	*phase = cycle_fraction((a + b) % m, m);
+	*incr = cycle_fraction(mulmod(110, rate + n % r2, r2), r2);
+	*incr2 = cycle_fraction(110 % r2, r2);
+}
+/* Position the signal generator at source sample n. */
+static void seek_audio_generator(Session *s, int64_t n)
+{
+	s->audio_src_pos = n;
+}
 
-static void open_audio(AVFormatContext *oc, AVCodec *codec, AVStream *st)
+static int open_audio(Session *s, const AVCodec *codec, AVStream *st)
 {
-	AVCodecContext *c;
+	AVCodecContext *c = s->audio_enc;
 	int ret;
-	c = st->codec;
-	/* allocate and init a re-usable frame */
-	audio_frame = av_frame_alloc();
-	if (!audio_frame) {
-		fprintf(stderr, "Could not allocate audio frame\n");
-		exit(1);
-	}
+	int nb_channels = c->ch_layout.nb_channels;
 	/* open it */
-	c->strict_std_compliance = oc->strict_std_compliance;
+	c->strict_std_compliance = s->oc->strict_std_compliance;
 	ret = avcodec_open2(c, codec, nullptr);
 	if (ret < 0) {
-//		fprintf(stderr, "Could not open audio codec: %s\n", av_err2str(ret));
-		exit(1);
+		fprintf(stderr, "%s: Could not open audio codec: %s\n", s->filename, err2str(ret).c_str());
+		return ret;
+	}
+	/* copy the stream parameters to the muxer */
+	ret = avcodec_parameters_from_context(st->codecpar, c);
+	if (ret < 0) {
+		fprintf(stderr, "%s: Could not copy the stream parameters: %s\n", s->filename, err2str(ret).c_str());
+		return ret;
 	}
+	int src_rate = resample.src_rate ? resample.src_rate : c->sample_rate;
+	s->audio_src_rate = src_rate;
 	/* init signal generator */
-	t     = 0;
-	tincr = 2 * M_PI * 110.0 / c->sample_rate;
-	/* increment frequency by 110 Hz per second */
-	tincr2 = 2 * M_PI * 110.0 / c->sample_rate / c->sample_rate;
-	src_nb_samples = c->frame_size;
-	ret = av_samples_alloc_array_and_samples(&src_samples_data, &src_samples_linesize, c->channels, src_nb_samples, AV_SAMPLE_FMT_S16, 0);
+	s->audio_src_pos = 0;
+	/* codecs with a variable frame size (PCM) report 0 */
+	s->src_nb_samples = c->frame_size ? c->frame_size : 1024;
+	/* the generator produces packed or planar 16 bit samples natively */
+	s->src_sample_fmt = c->sample_fmt == AV_SAMPLE_FMT_S16P ? AV_SAMPLE_FMT_S16P : AV_SAMPLE_FMT_S16;
+	/* allocate and init a re-usable frame, this is what the encoder reads */
+	AVFrame *audio_frame = s->audio_frame = av_frame_alloc();
+	if (!audio_frame) {
+		fprintf(stderr, "%s: Could not allocate audio frame\n", s->filename);
+		return AVERROR(ENOMEM);
+	}
+	audio_frame->format = c->sample_fmt;
+	audio_frame->sample_rate = c->sample_rate;
+	audio_frame->nb_samples = s->src_nb_samples;
+	av_channel_layout_copy(&audio_frame->ch_layout, &c->ch_layout);
+	ret = av_frame_get_buffer(audio_frame, 0);
 	if (ret < 0) {
-		fprintf(stderr, "Could not allocate source samples\n");
-		exit(1);
+		fprintf(stderr, "%s: Could not allocate audio samples: %s\n", s->filename, err2str(ret).c_str());
+		return ret;
+	}
+	if (c->codec_id == AV_CODEC_ID_PCM_S16LE && c->sample_fmt == s->src_sample_fmt && src_rate == c->sample_rate) {
+		s->audio_pkt_size = s->src_nb_samples * nb_channels * 2;
+		s->audio_pkt_pool = av_buffer_pool_init(s->audio_pkt_size, nullptr);
+		if (!s->audio_pkt_pool) {
+			fprintf(stderr, "%s: Could not allocate audio packet pool\n", s->filename);
+			return AVERROR(ENOMEM);
+		}
+		return 0;
+	}
+	if (c->sample_fmt == s->src_sample_fmt && src_rate == c->sample_rate) {
+		/* the generator writes into audio_frame directly */
+		return 0;
 	}
-	/* compute the number of converted samples: buffering is avoided
-	 * ensuring that the output buffer will contain at least all the
-	 * converted input samples */
-	max_dst_nb_samples = src_nb_samples;
 	/* create resampler context */
-	if (c->sample_fmt != AV_SAMPLE_FMT_S16) {
-		swr_ctx = swr_alloc();
-		if (!swr_ctx) {
-			fprintf(stderr, "Could not allocate resampler context\n");
-			exit(1);
-		}
-		/* set options */
-		av_opt_set_int       (swr_ctx, "in_channel_count",   c->channels,       0);
-		av_opt_set_int       (swr_ctx, "in_sample_rate",     c->sample_rate,    0);
-		av_opt_set_sample_fmt(swr_ctx, "in_sample_fmt",      AV_SAMPLE_FMT_S16, 0);
-		av_opt_set_int       (swr_ctx, "out_channel_count",  c->channels,       0);
-		av_opt_set_int       (swr_ctx, "out_sample_rate",    c->sample_rate,    0);
-		av_opt_set_sample_fmt(swr_ctx, "out_sample_fmt",     c->sample_fmt,     0);
-		/* initialize the resampling context */
-		if ((ret = swr_init(swr_ctx)) < 0) {
-			fprintf(stderr, "Failed to initialize the resampling context\n");
-			exit(1);
-		}
-		ret = av_samples_alloc_array_and_samples(&dst_samples_data, &dst_samples_linesize, c->channels, max_dst_nb_samples, c->sample_fmt, 0);
-		if (ret < 0) {
-			fprintf(stderr, "Could not allocate destination samples\n");
-			exit(1);
+	ret = av_samples_alloc_array_and_samples(&s->src_samples_data, &s->src_samples_linesize, nb_channels, s->src_nb_samples, s->src_sample_fmt, 0);
+	if (ret < 0) {
+		fprintf(stderr, "%s: Could not allocate source samples: %s\n", s->filename, err2str(ret).c_str());
+		return ret;
+	}
+	struct SwrContext *swr_ctx = s->swr_ctx = swr_alloc();
+	if (!swr_ctx) {
+		fprintf(stderr, "%s: Could not allocate resampler context\n", s->filename);
+		return AVERROR(ENOMEM);
+	}
+	/* set options */
+	av_opt_set_chlayout  (swr_ctx, "in_chlayout",        &c->ch_layout,     0);
+	av_opt_set_int       (swr_ctx, "in_sample_rate",     src_rate,          0);
+	av_opt_set_sample_fmt(swr_ctx, "in_sample_fmt",      s->src_sample_fmt, 0);
+	av_opt_set_chlayout  (swr_ctx, "out_chlayout",       &c->ch_layout,     0);
+	av_opt_set_int       (swr_ctx, "out_sample_rate",    c->sample_rate,    0);
+	av_opt_set_sample_fmt(swr_ctx, "out_sample_fmt",     c->sample_fmt,     0);
+	if (src_rate != c->sample_rate) {
+		const ResamplePreset *preset = resample.preset;
+		av_opt_set(swr_ctx, "resampler", resample.engine, 0);
+		av_opt_set_int(swr_ctx, "filter_size", resample.filter_size >= 0 ? resample.filter_size : preset->filter_size, 0);
+		av_opt_set_int(swr_ctx, "phase_shift", preset->phase_shift, 0);
+		av_opt_set_int(swr_ctx, "linear_interp", preset->linear_interp, 0);
+		av_opt_set_double(swr_ctx, "cutoff", preset->cutoff, 0);
+		av_opt_set_double(swr_ctx, "precision", resample.precision >= 0 ? resample.precision : preset->precision, 0);
+	}
+	/* initialize the resampling context */
+	if ((ret = swr_init(swr_ctx)) < 0) {
+		fprintf(stderr, "%s: Failed to initialize the resampling context (resampler '%s'): %s\n", s->filename, resample.engine, err2str(ret).c_str());
+		return ret;
+	}
+	if (src_rate != c->sample_rate) {
+		/* the number of converted samples varies per call, so they
+		 * are queued and handed to the encoder in frame_size chunks */
+		s->audio_fifo = av_audio_fifo_alloc(c->sample_fmt, nb_channels, s->src_nb_samples * 2);
+		s->rs_max_nb_samples = av_rescale_rnd(s->src_nb_samples, c->sample_rate, src_rate, AV_ROUND_UP) + 16;
+		ret = av_samples_alloc_array_and_samples(&s->rs_samples_data, &s->rs_samples_linesize, nb_channels, s->rs_max_nb_samples, c->sample_fmt, 0);
+		if (!s->audio_fifo || ret < 0) {
+			fprintf(stderr, "%s: Could not allocate resampler buffers\n", s->filename);
+			return ret < 0 ? ret : AVERROR(ENOMEM);
 		}
-	} else {
-		dst_samples_data = src_samples_data;
 	}
-	dst_samples_size = av_samples_get_buffer_size(nullptr, c->channels, max_dst_nb_samples, c->sample_fmt, 0);
+	return 0;
 }
-/* Prepare a 16 bit dummy audio frame of 'frame_size' samples and
- * 'nb_channels' channels. */
-static void get_audio_frame(int16_t *samples, int frame_size, int nb_channels)
+/* Samples [n0, n0 + frame_size) of the test tone, 16 bit, packed or
+ * planar. A pure function of n0: each frame starts from the exact phase,
+ * so frames can be produced in any order and rounding does not
+ * accumulate from one frame to the next. The audio_synth kernel steps
+ * the phase through the frame with integer accumulators. */
+static void synth_audio(uint8_t **samples, int planar, int64_t n0, int frame_size, int nb_channels, int rate)
 {
-	int j, i, v;
-	int16_t *q;
-	q = samples;
-	for (j = 0; j < frame_size; j++) {
-		v = (int)(sin(t) * 10000);
-		for (i = 0; i < nb_channels; i++) {
-			*q++ = v;
+	/* the same kernel in the table of every width */
+	const Kernels *k = kernels_get(0);
+	uint64_t phase, incr, incr2;
+	audio_phase(n0, rate, &phase, &incr, &incr2);
+	if (planar || nb_channels == 1) {
+		k->audio_synth((int16_t *)samples[0], frame_size, phase, incr, incr2);
+		for (int i = 1; i < nb_channels; i++) {
+			memcpy(samples[i], samples[0], frame_size * sizeof(int16_t));
+		}
+		return;
+	}
+	/* packed: one channel a block at a time, then copied to all */
+	int16_t mono[256];
+	int16_t *q = (int16_t *)samples[0];
+	for (int j = 0; j < frame_size; j += 256) {
+		int n = FFMIN(256, frame_size - j);
+		k->audio_synth(mono, n, phase, incr, incr2);
+		audio_synth_advance(&phase, &incr, incr2, n);
+		for (int x = 0; x < n; x++) {
+			for (int i = 0; i < nb_channels; i++) {
+				*q++ = mono[x];
+			}
 		}
-		t     += tincr;
-		tincr += tincr2;
 	}
 }
-static void write_audio_frame(AVFormatContext *oc, AVStream *st, int flush)
+static void get_audio_frame(Session *s, uint8_t **samples, int planar, int frame_size, int nb_channels)
 {
-	AVCodecContext *c;
-	AVPacket pkt = {}; // data and size must be 0;
-	int got_packet, ret, dst_nb_samples;
-	av_init_packet(&pkt);
-	c = st->codec;
+	synth_audio(samples, planar, s->audio_src_pos, frame_size, nb_channels, s->audio_src_rate);
+	s->audio_src_pos += frame_size;
+}
+/* Run the resampler on 'nb_samples' input samples (nullptr to drain its
+ * delay) and queue the output in the FIFO. */
+static int resample_into_fifo(Session *s, AVCodecContext *c, uint8_t **in, int nb_samples)
+{
+	int ret, out_nb_samples;
+	out_nb_samples = swr_get_out_samples(s->swr_ctx, nb_samples);
+	if (out_nb_samples > s->rs_max_nb_samples) {
+		av_freep(&s->rs_samples_data[0]);
+		ret = av_samples_alloc(s->rs_samples_data, &s->rs_samples_linesize, c->ch_layout.nb_channels, out_nb_samples, c->sample_fmt, 0);
+		if (ret < 0) {
+			return ret;
+		}
+		s->rs_max_nb_samples = out_nb_samples;
+	}
+	uint64_t t0 = bench_begin(BENCH_AUDIO_RESAMPLE);
+	ret = swr_convert(s->swr_ctx, s->rs_samples_data, s->rs_max_nb_samples, (const uint8_t **)in, nb_samples);
+	bench_end(BENCH_AUDIO_RESAMPLE, t0);
+	if (ret < 0) {
+		fprintf(stderr, "%s: Error while converting: %s\n", s->filename, err2str(ret).c_str());
+		return ret;
+	}
+	if (av_audio_fifo_write(s->audio_fifo, (void **)s->rs_samples_data, ret) < ret) {
+		fprintf(stderr, "%s: Could not queue resampled samples\n", s->filename);
+		return AVERROR(ENOMEM);
+	}
+	return 0;
+}
+/* Fill audio_frame with one encoder frame of rate converted samples.
+ * On flush the resampler delay is drained and the last frame is padded
+ * with silence. Returns the number of samples, 0 once everything has been
+ * returned, or a negative error code. */
+static int get_resampled_frame(Session *s, AVCodecContext *c, int flush)
+{
+	int ret;
+	AVFrame *audio_frame = s->audio_frame;
+	int frame_size = audio_frame->nb_samples;
+	int nb_channels = c->ch_layout.nb_channels;
 	if (!flush) {
-		get_audio_frame((int16_t *)src_samples_data[0], src_nb_samples, c->channels);
-		/* convert samples from native format to destination codec format, using the resampler */
-		if (swr_ctx) {
-			/* compute destination number of samples */
-			dst_nb_samples = av_rescale_rnd(swr_get_delay(swr_ctx, c->sample_rate) + src_nb_samples, c->sample_rate, c->sample_rate, AV_ROUND_UP);
-			if (dst_nb_samples > max_dst_nb_samples) {
-				av_free(dst_samples_data[0]);
-				ret = av_samples_alloc(dst_samples_data, &dst_samples_linesize, c->channels, dst_nb_samples, c->sample_fmt, 0);
-				if (ret < 0) {
-					exit(1);
-				}
-				max_dst_nb_samples = dst_nb_samples;
-				dst_samples_size = av_samples_get_buffer_size(nullptr, c->channels, dst_nb_samples, c->sample_fmt, 0);
-			}
-			/* convert to destination format */
-			ret = swr_convert(swr_ctx, dst_samples_data, dst_nb_samples, (const uint8_t **)src_samples_data, src_nb_samples);
-			if (ret < 0) {
-				fprintf(stderr, "Error while converting\n");
-				exit(1);
-			}
-		} else {
-			dst_nb_samples = src_nb_samples;
+		while (av_audio_fifo_size(s->audio_fifo) < frame_size) {
+			uint64_t t0 = bench_begin(BENCH_AUDIO_GENERATE);
+			get_audio_frame(s, s->src_samples_data, s->src_sample_fmt == AV_SAMPLE_FMT_S16P, s->src_nb_samples, nb_channels);
+			bench_end(BENCH_AUDIO_GENERATE, t0);
+			ret = resample_into_fifo(s, c, s->src_samples_data, s->src_nb_samples);
+			if (ret < 0) return ret;
 		}
-		audio_frame->nb_samples = dst_nb_samples;
-		AVRational rate = {1, c->sample_rate};
-		audio_frame->pts = av_rescale_q(samples_count, rate, c->time_base);
-		avcodec_fill_audio_frame(audio_frame, c->channels, c->sample_fmt, dst_samples_data[0], dst_samples_size, 0);
-		samples_count += dst_nb_samples;
+	} else if (!s->audio_fifo_drained) {
+		ret = resample_into_fifo(s, c, nullptr, 0);
+		if (ret < 0) return ret;
+		s->audio_fifo_drained = 1;
 	}
-	ret = avcodec_encode_audio2(c, &pkt, flush ? nullptr : audio_frame, &got_packet);
+	int n = av_audio_fifo_read(s->audio_fifo, (void **)audio_frame->data, frame_size);
+	if (n <= 0) return n;
+	if (n < frame_size) {
+		av_samples_set_silence(audio_frame->data, n, frame_size - n, nb_channels, c->sample_fmt);
+	}
+	return frame_size;
+}
+/* Write a PCM frame without going through the encoder: the generator
+ * fills a pooled buffer whose reference is passed on to the muxer. */
+static int write_audio_passthrough(Session *s, AVStream *st, int flush)
+{
+	AVCodecContext *c = s->audio_enc;
+	AVPacket *pkt = s->pkt;
+	int ret;
+	if (flush) {
+		s->audio_is_eof = 1;
+		return 0;
+	}
+	av_packet_unref(pkt);
+	pkt->buf = av_buffer_pool_get(s->audio_pkt_pool);
+	if (!pkt->buf) {
+		fprintf(stderr, "%s: Could not allocate audio packet\n", s->filename);
+		return AVERROR(ENOMEM);
+	}
+	pkt->data = pkt->buf->data;
+	pkt->size = s->audio_pkt_size;
+	uint64_t t0 = bench_begin(BENCH_AUDIO_GENERATE);
+	get_audio_frame(s, &pkt->data, 0, s->src_nb_samples, c->ch_layout.nb_channels);
+	bench_end(BENCH_AUDIO_GENERATE, t0);
+	pkt->pts = pkt->dts = s->samples_count;
+	pkt->duration = s->src_nb_samples;
+	pkt->flags |= AV_PKT_FLAG_KEY;
+	s->samples_count += s->src_nb_samples;
+	ret = write_frame(s, &c->time_base, st, pkt);
 	if (ret < 0) {
-//		fprintf(stderr, "Error encoding audio frame: %s\n", av_err2str(ret));
-		exit(1);
+		fprintf(stderr, "%s: Error while writing audio frame: %s\n", s->filename, err2str(ret).c_str());
+		return ret;
 	}
-	if (!got_packet) {
-		if (flush) {
-			audio_is_eof = 1;
+	s->audio_pts = (double)s->samples_count * st->time_base.den / st->time_base.num / c->sample_rate;
+	return 0;
+}
+static int write_audio_frame(Session *s, AVStream *st, int flush)
+{
+	AVCodecContext *c = s->audio_enc;
+	AVFrame *audio_frame = s->audio_frame;
+	int ret, dst_nb_samples = 0;
+	uint64_t t0;
+	if (s->audio_pkt_pool) {
+		return write_audio_passthrough(s, st, flush);
+	}
+	/* the encoder may still reference the previous frame's buffer */
+	ret = av_frame_make_writable(audio_frame);
+	if (ret < 0) return ret;
+	if (s->audio_fifo) {
+		dst_nb_samples = get_resampled_frame(s, c, flush);
+		if (dst_nb_samples < 0) return dst_nb_samples;
+	} else if (!flush) {
+		dst_nb_samples = s->src_nb_samples;
+		if (s->swr_ctx) {
+			t0 = bench_begin(BENCH_AUDIO_GENERATE);
+			get_audio_frame(s, s->src_samples_data, s->src_sample_fmt == AV_SAMPLE_FMT_S16P, s->src_nb_samples, c->ch_layout.nb_channels);
+			bench_end(BENCH_AUDIO_GENERATE, t0);
+			/* convert samples from native format to destination codec format, using the resampler */
+			t0 = bench_begin(BENCH_AUDIO_RESAMPLE);
+			ret = swr_convert(s->swr_ctx, audio_frame->data, dst_nb_samples, (const uint8_t **)s->src_samples_data, s->src_nb_samples);
+			bench_end(BENCH_AUDIO_RESAMPLE, t0);
+			if (ret < 0) {
+				fprintf(stderr, "%s: Error while converting: %s\n", s->filename, err2str(ret).c_str());
+				return ret;
+			}
+		} else {
+			/* no conversion: generate straight into the encoder's frame */
+			t0 = bench_begin(BENCH_AUDIO_GENERATE);
+			get_audio_frame(s, audio_frame->data, s->src_sample_fmt == AV_SAMPLE_FMT_S16P, s->src_nb_samples, c->ch_layout.nb_channels);
+			bench_end(BENCH_AUDIO_GENERATE, t0);
 		}
-		return;
 	}
-	ret = write_frame(oc, &c->time_base, st, &pkt);
+	if (dst_nb_samples > 0) {
+		audio_frame->pts = s->samples_count;
+		s->samples_count += dst_nb_samples;
+	}
+	ret = encode_frame(s, c, st, dst_nb_samples > 0 ? audio_frame : nullptr, BENCH_AUDIO_ENCODE);
 	if (ret < 0) {
-//		fprintf(stderr, "Error while writing audio frame: %s\n", av_err2str(ret));
-		exit(1);
+		return ret;
 	}
-	audio_pts = (double)samples_count * st->time_base.den / st->time_base.num / c->sample_rate;
+	if (ret == 1) {
+		s->audio_is_eof = 1;
+	}
+	s->audio_pts = (double)s->samples_count * st->time_base.den / st->time_base.num / c->sample_rate;
+	return 0;
 }
-static void close_audio(AVFormatContext *oc, AVStream *st)
+static void close_audio(Session *s)
 {
-	(void)oc;
-	avcodec_close(st->codec);
-	if (dst_samples_data != src_samples_data) {
-		av_free(dst_samples_data[0]);
-		av_free(dst_samples_data);
+	avcodec_free_context(&s->audio_enc);
+	if (s->rs_samples_data) {
+		av_free(s->rs_samples_data[0]);
+		av_freep(&s->rs_samples_data);
 	}
-	av_free(src_samples_data[0]);
-	av_free(src_samples_data);
-	av_frame_free(&audio_frame);
+	if (s->audio_fifo) {
+		av_audio_fifo_free(s->audio_fifo);
+	}
+	swr_free(&s->swr_ctx);
+	if (s->src_samples_data) {
+		av_free(s->src_samples_data[0]);
+		av_freep(&s->src_samples_data);
+	}
+	av_frame_free(&s->audio_frame);
+	av_buffer_pool_uninit(&s->audio_pkt_pool);
 }
 /**************************************************************/
 /* video output */
-static AVFrame *frame;
-static AVPicture src_picture, dst_picture;
-static int frame_count;
 
-static void open_video(AVFormatContext *oc, AVCodec *codec, AVStream *st)
+/* Picture buffers: every plane starts on a FRAME_ALIGN boundary and every
+ * line is padded to a multiple of FRAME_ALIGN bytes, so row kernels can use
+ * aligned loads and full-width stores up to linesize without a tail loop.
+ * av_frame_get_buffer() only aligns to what av_malloc() was built with, so
+ * the buffer is allocated here. */
+#define FRAME_ALIGN 64
+/* The first FRAME_ALIGN bytes of a buffer hold its size, for the budget
+ * (the opaque pointer) it was charged to. */
+static void free_picture_buffer(void *opaque, uint8_t *data)
+{
+	if (opaque) {
+		size_t total;
+		memcpy(&total, data, sizeof(total));
+		((ByteBudget *)opaque)->release(total);
+	}
+	aligned_free(data);
+}
+/* Line sizes and plane offsets of a picture buffer; returns its size in
+ * bytes, 0 on error. */
+static size_t picture_layout(enum AVPixelFormat pix_fmt, int width, int height, int linesize[4], size_t offset[4])
+{
+	ptrdiff_t linesizes[4];
+	size_t plane_size[4], total = FRAME_ALIGN; /* size header */
+	if (av_image_fill_linesizes(linesize, pix_fmt, width) < 0) return 0;
+	for (int i = 0; i < 4; i++) {
+		linesize[i] = FFALIGN(linesize[i], FRAME_ALIGN);
+		linesizes[i] = linesize[i];
+	}
+	if (av_image_fill_plane_sizes(plane_size, pix_fmt, height, linesizes) < 0) return 0;
+	for (int i = 0; i < 4; i++) {
+		offset[i] = plane_size[i] ? total : 0;
+		total += FFALIGN(plane_size[i], FRAME_ALIGN);
+	}
+	/* one spare vector for kernels reading past the last line */
+	return total + FRAME_ALIGN;
+}
+static size_t picture_size(enum AVPixelFormat pix_fmt, int width, int height)
+{
+	int linesize[4];
+	size_t offset[4];
+	return picture_layout(pix_fmt, width, height, linesize, offset);
+}
+/* Allocate a picture, charged to 'budget' (may be null) until its buffer
+ * is freed. With 'wait' the charge waits for room in the budget (see
+ * ByteBudget::acquire), and nullptr is also returned once it is closed. */
+static AVFrame *alloc_picture(enum AVPixelFormat pix_fmt, int width, int height, ByteBudget *budget, bool wait)
+{
+	int linesize[4];
+	size_t offset[4];
+	void *buf;
+	size_t total = picture_layout(pix_fmt, width, height, linesize, offset);
+	if (!total) return nullptr;
+	if (budget) {
+		if (!wait) budget->force(total);
+		else if (!budget->acquire(total)) return nullptr;
+	}
+	buf = aligned_malloc(total, FRAME_ALIGN);
+	if (!buf) {
+		if (budget) budget->release(total);
+		return nullptr;
+	}
+	memcpy(buf, &total, sizeof(total));
+	AVFrame *picture = av_frame_alloc();
+	if (picture) {
+		picture->buf[0] = av_buffer_create((uint8_t *)buf, total, free_picture_buffer, budget, 0);
+	}
+	if (!picture || !picture->buf[0]) {
+		free_picture_buffer(budget, (uint8_t *)buf);
+		av_frame_free(&picture);
+		return nullptr;
+	}
+	picture->format = pix_fmt;
+	picture->width  = width;
+	picture->height = height;
+	for (int i = 0; i < 4 && offset[i]; i++) {
+		picture->data[i] = (uint8_t *)buf + offset[i];
+		picture->linesize[i] = linesize[i];
+	}
+	return picture;
+}
+/* The encoder may keep a reference to a frame it was given. Instead of
+ * av_frame_make_writable(), which copies into a default-aligned buffer,
+ * swap in a fresh picture: the caller overwrites all of it anyway. The
+ * new picture is charged to the old one's budget, waiting for the
+ * encoder to release enough; AVERROR_EXIT once the budget is closed. */
+static int make_picture_writable(AVFrame *picture)
+{
+	if (av_frame_is_writable(picture)) return 0;
+	ByteBudget *budget = (ByteBudget *)av_buffer_get_opaque(picture->buf[0]);
+	AVFrame *tmp = alloc_picture((enum AVPixelFormat)picture->format, picture->width, picture->height, budget, true);
+	if (!tmp) return budget && budget->closed() ? AVERROR_EXIT : AVERROR(ENOMEM);
+	tmp->pts = picture->pts;
+	av_frame_unref(picture);
+	av_frame_move_ref(picture, tmp);
+	av_frame_free(&tmp);
+	return 0;
+}
+
+static int open_video(Session *s, const AVCodec *codec, AVStream *st)
 {
-	(void)oc;
 	int ret;
-	AVCodecContext *c = st->codec;
+	AVCodecContext *c = s->video_enc;
 	/* open the codec */
 	ret = avcodec_open2(c, codec, nullptr);
 	if (ret < 0) {
-//		fprintf(stderr, "Could not open video codec: %s\n", av_err2str(ret));
-		exit(1);
+		fprintf(stderr, "%s: Could not open video codec: %s\n", s->filename, err2str(ret).c_str());
+		return ret;
 	}
-	/* allocate and init a re-usable frame */
-	frame = av_frame_alloc();
-	if (!frame) {
-		fprintf(stderr, "Could not allocate video frame\n");
-		exit(1);
-	}
-	frame->format = c->pix_fmt;
-	frame->width = c->width;
-	frame->height = c->height;
-	/* Allocate the encoded raw picture. */
-	ret = avpicture_alloc(&dst_picture, c->pix_fmt, c->width, c->height);
+	/* copy the stream parameters to the muxer */
+	ret = avcodec_parameters_from_context(st->codecpar, c);
 	if (ret < 0) {
-//		fprintf(stderr, "Could not allocate picture: %s\n", av_err2str(ret));
-		exit(1);
+		fprintf(stderr, "%s: Could not copy the stream parameters: %s\n", s->filename, err2str(ret).c_str());
+		return ret;
 	}
-	ret = avpicture_alloc(&src_picture, AV_PIX_FMT_RGB24, c->width, c->height);
-	if (ret < 0) {
-//		fprintf(stderr, "Could not allocate temporary picture: %s\n", av_err2str(ret));
-		exit(1);
+	/* allocate and init a re-usable frame */
+	s->frame = alloc_picture(c->pix_fmt, c->width, c->height, &s->frame_budget, false);
+	if (!s->frame) {
+		fprintf(stderr, "%s: Could not allocate video frame\n", s->filename);
+		return AVERROR(ENOMEM);
+	}
+	/* the pattern is generated in RGB24 into a temporary picture */
+	s->kernels = kernels_get(c->width);
+	s->pattern = pattern_lut_get(c->width, c->height);
+	if (!s->pattern) {
+		fprintf(stderr, "%s: Could not allocate pattern tables\n", s->filename);
+		return AVERROR(ENOMEM);
+	}
+	s->chroma_shift = av_pix_fmt_desc_get(c->pix_fmt)->log2_chroma_h;
+	if (convert_mode == CONVERT_FUSED) {
+		if (c->pix_fmt == AV_PIX_FMT_YUV420P) {
+			s->fused = true;
+			return 0;
+		}
+		fprintf(stderr, "%s: No fused kernel for %s, generating and converting separately\n", s->filename, pix_fmt_entry->name);
+	}
+	/* Large pictures do not fit in the cache, so the converter would read
+	 * back every RGB24 row from memory. Generate and convert them in
+	 * horizontal tiles instead, reusing one tile sized buffer. The
+	 * generate stage of the pipeline produces whole pictures, render
+	 * workers tile like the serial loop. */
+	s->tile_rows = pipeline_enabled && !prefetch_workers ? 0 : tile_rows;
+	if (s->tile_rows < 0) {
+		s->tile_rows = 0;
+		if ((int64_t)c->width * c->height >= 3840 * 2160) {
+			/* RGB24 plus the widest output, 3 bytes a pixel (4:4:4, or
+			 * 10-bit 4:2:0 averaged over a row pair); the even row count
+			 * nearest to the budget: 12 rows at 4K, 6 at 8K */
+			int row_bytes = 3 * c->width + 3 * c->width;
+			s->tile_rows = FFMAX((TILE_CACHE_BYTES + row_bytes) / (2 * row_bytes) * 2, 2);
+		}
+	}
+	if (s->tile_rows >= c->height) s->tile_rows = 0;
+	s->tmp_frame = alloc_picture(AV_PIX_FMT_RGB24, c->width, s->tile_rows ? s->tile_rows : c->height, &s->frame_budget, false);
+	if (!s->tmp_frame) {
+		fprintf(stderr, "%s: Could not allocate temporary picture\n", s->filename);
+		return AVERROR(ENOMEM);
+	}
+	if (convert_mode != CONVERT_SWS) {
+		return 0;
+	}
+	/* as we only generate a RGB24 picture, we must convert it
+	 * to the codec pixel format if needed */
+	s->sws_ctx = sws_getContext(c->width, c->height, AV_PIX_FMT_RGB24, c->width, c->height, c->pix_fmt, sws_flags, nullptr, nullptr, nullptr);
+	if (!s->sws_ctx) {
+		fprintf(stderr, "%s: Could not initialize the conversion context\n", s->filename);
+		return AVERROR(EINVAL);
 	}
-	/* copy data and linesize picture pointers to frame */
-	*((AVPicture *)frame) = dst_picture;
+	return 0;
 }
 /* Prepare a dummy image. */
-static void fill_rgb_image(AVPicture *pict, int frame_index, int width, int height)
-{
-	int x, y, i;
-	i = frame_index;
-	/* Y */
-	for (y = 0; y < height; y++) {
-		uint8_t *p = &pict->data[0][y * pict->linesize[0]];
-		for (x = 0; x < width; x++) {
-			int r = x * 255 / width;
-			int g = y * 255 / height;
-			int b = (((x + i) ^ (y + i)) & 64) ? 0 : 255;
-			p[0] = r;
-			p[1] = g;
-			p[2] = b;
-			p += 3;
-		}
+static void fill_rgb_image(Session *s, AVFrame *pict, int frame_index, int width, int height)
+{
+	for (int y = 0; y < height; y++) {
+		s->kernels->pattern_row(&pict->data[0][y * pict->linesize[0]], s->pattern, y, frame_index);
 	}
 	/* Cb and Cr */
 //	for (y = 0; y < height / 2; y++) {
@@ -347,167 +1370,953 @@ static void fill_rgb_image(AVPicture *pict, int frame_index, int width, int heig
 //		}
 //	}
 }
-static void write_video_frame(AVFormatContext *oc, AVStream *st, int flush)
+/* Convert RGB24 rows [y0, y0 + rows) of the picture into the encoder's
+ * pixel format, with libswscale if sws is set and the internal kernels
+ * otherwise. src points at row y0; rows must be even except for the last
+ * slice of the picture, and slices must come in order. */
+static void convert_rows(Session *s, struct SwsContext *sws, uint8_t *const src[4], const int src_linesize[4], AVFrame *dst, int y0, int rows, int width)
+{
+	if (sws) {
+		sws_scale(sws, (const uint8_t * const *)src, src_linesize, y0, rows, dst->data, dst->linesize);
+		return;
+	}
+	void (*to_yuv)(const uint8_t *, const uint8_t *, uint8_t *const *, uint8_t *const *, int) = s->kernels->to_yuv[pix_fmt_entry->kernel];
+	for (int i = 0; i < rows; i += 2) {
+		int i1 = i + 1 < rows ? i + 1 : i;
+		int y = y0 + i, y1 = y0 + i1;
+		uint8_t *row0[3] = {}, *row1[3] = {};
+		for (int p = 0; p < 3 && dst->data[p]; p++) {
+			int shift = p ? s->chroma_shift : 0;
+			row0[p] = dst->data[p] + (y >> shift) * dst->linesize[p];
+			row1[p] = dst->data[p] + (y1 >> shift) * dst->linesize[p];
+		}
+		to_yuv(src[0] + i * src_linesize[0], src[0] + i1 * src_linesize[0], row0, row1, width);
+	}
+}
+static void convert_picture(Session *s, const AVFrame *src, AVFrame *dst, int width, int height)
+{
+	convert_rows(s, s->sws_ctx, src->data, src->linesize, dst, 0, height, width);
+}
+/* Generate and convert the picture one tile at a time through the tile
+ * sized picture 'tile', so the converter reads RGB24 rows from the cache. */
+static void fill_tiled(Session *s, AVFrame *tile, struct SwsContext *sws, AVFrame *dst, int frame_index, int width, int height)
+{
+	for (int y0 = 0; y0 < height; y0 += s->tile_rows) {
+		int rows = FFMIN(s->tile_rows, height - y0);
+		uint64_t t0 = bench_begin(BENCH_VIDEO_GENERATE);
+		for (int i = 0; i < rows; i++) {
+			s->kernels->pattern_row(tile->data[0] + i * tile->linesize[0], s->pattern, y0 + i, frame_index);
+		}
+		bench_end(BENCH_VIDEO_GENERATE, t0);
+		t0 = bench_begin(BENCH_VIDEO_CONVERT);
+		convert_rows(s, sws, tile->data, tile->linesize, dst, y0, rows, width);
+		bench_end(BENCH_VIDEO_CONVERT, t0);
+	}
+}
+/* Generate the pattern straight into a YUV420P picture. */
+static void fill_yuv_image(Session *s, AVFrame *pict, int frame_index, int height)
+{
+	for (int y = 0; y < height; y += 2) {
+		int y1 = y + 1 < height ? y + 1 : y;
+		uint8_t *row0[3], *row1[3];
+		for (int p = 0; p < 3; p++) {
+			row0[p] = pict->data[p] + (p ? y / 2 : y) * pict->linesize[p];
+			row1[p] = pict->data[p] + (p ? y1 / 2 : y1) * pict->linesize[p];
+		}
+		s->kernels->pattern_yuv420p(s->pattern, y, frame_index, row0, row1);
+	}
+}
+/* Produce picture 'frame_index' in the encoder's format: fused, tiled or
+ * whole, as open_video() chose. rgb is the RGB24 scratch picture (one
+ * tile high when tiling, unused when fused) and sws the conversion
+ * context; each thread rendering pictures needs its own of both. */
+static void render_picture(Session *s, AVFrame *rgb, struct SwsContext *sws, AVFrame *dst, int frame_index, int width, int height)
+{
+	if (s->fused) {
+		uint64_t t0 = bench_begin(BENCH_VIDEO_FUSED);
+		fill_yuv_image(s, dst, frame_index, height);
+		bench_end(BENCH_VIDEO_FUSED, t0);
+	} else if (s->tile_rows) {
+		fill_tiled(s, rgb, sws, dst, frame_index, width, height);
+	} else {
+		uint64_t t0 = bench_begin(BENCH_VIDEO_GENERATE);
+		fill_rgb_image(s, rgb, frame_index, width, height);
+		bench_end(BENCH_VIDEO_GENERATE, t0);
+		t0 = bench_begin(BENCH_VIDEO_CONVERT);
+		convert_rows(s, sws, rgb->data, rgb->linesize, dst, 0, height, width);
+		bench_end(BENCH_VIDEO_CONVERT, t0);
+	}
+}
+static void generate_stage(Session *s, int start, int width, int height)
+{
+	Pipeline *pipe = s->pipe;
+	AVFrame *f;
+	for (int i = start; pipe->rgb_free_ring.pop(&f); i++) {
+		uint64_t t0 = bench_begin(BENCH_VIDEO_GENERATE);
+		fill_rgb_image(s, f, i, width, height);
+		bench_end(BENCH_VIDEO_GENERATE, t0);
+		f->pts = i;
+		if (!pipe->rgb_ready_ring.push(f)) break;
+	}
+}
+static void convert_stage(Session *s, int width, int height)
+{
+	Pipeline *pipe = s->pipe;
+	AVFrame *src, *dst;
+	while (pipe->rgb_ready_ring.pop(&src)) {
+		if (!pipe->yuv_free_ring.pop(&dst)) break;
+		/* the encoder may still hold a reference to this picture */
+		int ret = make_picture_writable(dst);
+		if (ret == AVERROR_EXIT) break;
+		if (ret < 0) {
+			fprintf(stderr, "%s: Could not make video frame writable: %s\n", s->filename, err2str(ret).c_str());
+			pipeline_fail(s, ret);
+			break;
+		}
+		uint64_t t0 = bench_begin(BENCH_VIDEO_CONVERT);
+		convert_picture(s, src, dst, width, height);
+		bench_end(BENCH_VIDEO_CONVERT, t0);
+		dst->pts = src->pts;
+		pipe->rgb_free_ring.push(src);
+		if (!pipe->yuv_ready_ring.push(dst)) break;
+	}
+}
+/* Generation and conversion in one stage, for the fused kernel. */
+static void fused_stage(Session *s, int start, int height)
+{
+	Pipeline *pipe = s->pipe;
+	AVFrame *f;
+	for (int i = start; pipe->yuv_free_ring.pop(&f); i++) {
+		int ret = make_picture_writable(f);
+		if (ret == AVERROR_EXIT) break;
+		if (ret < 0) {
+			fprintf(stderr, "%s: Could not make video frame writable: %s\n", s->filename, err2str(ret).c_str());
+			pipeline_fail(s, ret);
+			break;
+		}
+		uint64_t t0 = bench_begin(BENCH_VIDEO_FUSED);
+		fill_yuv_image(s, f, i, height);
+		bench_end(BENCH_VIDEO_FUSED, t0);
+		f->pts = i;
+		if (!pipe->yuv_ready_ring.push(f)) break;
+	}
+}
+/* Render worker: frames start, start + step, ... until its rings close. */
+static void render_stage(Session *s, RenderWorker *w, int start, int step, int width, int height)
+{
+	AVFrame *f;
+	for (int i = start; w->free_ring.pop(&f); i += step) {
+		int ret = make_picture_writable(f);
+		if (ret == AVERROR_EXIT) break;
+		if (ret < 0) {
+			fprintf(stderr, "%s: Could not make video frame writable: %s\n", s->filename, err2str(ret).c_str());
+			pipeline_fail(s, ret);
+			break;
+		}
+		render_picture(s, w->rgb, w->sws_ctx, f, i, width, height);
+		f->pts = i;
+		if (!w->ready_ring.push(f)) break;
+	}
+}
+/* Frames per ring that fit in what is left of the frame budget after
+ * 'reserve' bytes, with 'rings' rings of 'slot_size' byte frames. Producers
+ * stall on the free rings once that many frames are in flight. At least
+ * one, the pipeline cannot run with less. */
+static int budget_depth(Session *s, size_t slot_size, int rings, int max, size_t reserve)
+{
+	int64_t limit = s->frame_budget.limit();
+	if (!limit) return max;
+	int64_t room = limit - s->frame_budget.used() - (int64_t)reserve;
+	int64_t depth = room > 0 ? room / ((int64_t)slot_size * rings) : 0;
+	if (depth < 1) {
+		fprintf(stderr, "%s: Frame memory budget too small, running with one frame per stage\n", s->filename);
+		return 1;
+	}
+	return (int)FFMIN(depth, (int64_t)max);
+}
+/* Frame-parallel rendering. The pattern is a pure function of the frame
+ * index, so worker n of N renders frames start + n, start + n + N, ...
+ * and the encoder takes one frame from each worker in turn, which keeps
+ * them in order without reordering. */
+static int start_render_workers(Session *s)
+{
+	AVCodecContext *c = s->video_enc;
+	Pipeline *pipe = s->pipe;
+	int rgb_height = s->tile_rows ? s->tile_rows : c->height;
+	size_t rgb_size = s->fused ? 0 : picture_size(AV_PIX_FMT_RGB24, c->width, rgb_height);
+	int depth = budget_depth(s, picture_size(c->pix_fmt, c->width, c->height), prefetch_workers, PREFETCH_FRAMES, prefetch_workers * rgb_size);
+	for (int n = 0; n < prefetch_workers; n++) {
+		RenderWorker *w = pipe->workers[n] = new RenderWorker;
+		pipe->nb_workers = n + 1;
+		for (int i = 0; i < depth; i++) {
+			w->pool[i] = alloc_picture(c->pix_fmt, c->width, c->height, &s->frame_budget, false);
+			if (!w->pool[i]) {
+				fprintf(stderr, "%s: Could not allocate pipeline frames\n", s->filename);
+				return AVERROR(ENOMEM);
+			}
+			w->free_ring.push(w->pool[i]);
+		}
+		if (!s->fused) {
+			w->rgb = alloc_picture(AV_PIX_FMT_RGB24, c->width, rgb_height, &s->frame_budget, false);
+			if (!w->rgb) {
+				fprintf(stderr, "%s: Could not allocate pipeline frames\n", s->filename);
+				return AVERROR(ENOMEM);
+			}
+		}
+		/* a conversion context must not be used by two threads at once */
+		if (s->sws_ctx) {
+			w->sws_ctx = sws_getContext(c->width, c->height, AV_PIX_FMT_RGB24, c->width, c->height, c->pix_fmt, sws_flags, nullptr, nullptr, nullptr);
+			if (!w->sws_ctx) {
+				fprintf(stderr, "%s: Could not initialize the conversion context\n", s->filename);
+				return AVERROR(EINVAL);
+			}
+		}
+	}
+	for (int n = 0; n < pipe->nb_workers; n++) {
+		pipe->workers[n]->thread = std::thread(render_stage, s, pipe->workers[n], s->frame_count + n, pipe->nb_workers, c->width, c->height);
+	}
+	return 0;
+}
+static int start_pipeline(Session *s)
+{
+	AVCodecContext *c = s->video_enc;
+	Pipeline *pipe = s->pipe = new Pipeline;
+	for (int i = 0; i < PIPELINE_PACKETS; i++) {
+		pipe->pkt_pool[i] = av_packet_alloc();
+		if (!pipe->pkt_pool[i]) {
+			fprintf(stderr, "%s: Could not allocate packet\n", s->filename);
+			return AVERROR(ENOMEM);
+		}
+	}
+	pipe->pkt_free_ring.push_n(pipe->pkt_pool, PIPELINE_PACKETS);
+	pipe->mux_thread = std::thread(mux_stage, s);
+	if (!c) return 0;
+	if (prefetch_workers) return start_render_workers(s);
+	size_t slot_size = picture_size(c->pix_fmt, c->width, c->height);
+	if (!s->fused) slot_size += picture_size(AV_PIX_FMT_RGB24, c->width, c->height);
+	int depth = budget_depth(s, slot_size, 1, PIPELINE_FRAMES, 0);
+	for (int i = 0; i < depth; i++) {
+		if (!s->fused) {
+			pipe->rgb_pool[i] = alloc_picture(AV_PIX_FMT_RGB24, c->width, c->height, &s->frame_budget, false);
+		}
+		pipe->yuv_pool[i] = alloc_picture(c->pix_fmt, c->width, c->height, &s->frame_budget, false);
+		if ((!s->fused && !pipe->rgb_pool[i]) || !pipe->yuv_pool[i]) {
+			fprintf(stderr, "%s: Could not allocate pipeline frames\n", s->filename);
+			return AVERROR(ENOMEM);
+		}
+		if (!s->fused) pipe->rgb_free_ring.push(pipe->rgb_pool[i]);
+		pipe->yuv_free_ring.push(pipe->yuv_pool[i]);
+	}
+	if (s->fused) {
+		pipe->generate_thread = std::thread(fused_stage, s, s->frame_count, c->height);
+		return 0;
+	}
+	pipe->generate_thread = std::thread(generate_stage, s, s->frame_count, c->width, c->height);
+	pipe->convert_thread = std::thread(convert_stage, s, c->width, c->height);
+	return 0;
+}
+/* Stop the stage threads; packets already queued are still written. */
+static int stop_pipeline(Session *s)
+{
+	Pipeline *pipe = s->pipe;
+	s->frame_budget.close();
+	pipe->rgb_free_ring.close();
+	pipe->rgb_ready_ring.close();
+	pipe->yuv_free_ring.close();
+	pipe->yuv_ready_ring.close();
+	if (pipe->generate_thread.joinable()) pipe->generate_thread.join();
+	if (pipe->convert_thread.joinable()) pipe->convert_thread.join();
+	for (int i = 0; i < pipe->nb_workers; i++) {
+		RenderWorker *w = pipe->workers[i];
+		w->free_ring.close();
+		w->ready_ring.close();
+		if (w->thread.joinable()) w->thread.join();
+		for (int j = 0; j < PREFETCH_FRAMES; j++) {
+			av_frame_free(&w->pool[j]);
+		}
+		av_frame_free(&w->rgb);
+		sws_freeContext(w->sws_ctx);
+		delete w;
+	}
+	pipe->pkt_ready_ring.close();
+	if (pipe->mux_thread.joinable()) pipe->mux_thread.join();
+	for (int i = 0; i < PIPELINE_FRAMES; i++) {
+		av_frame_free(&pipe->rgb_pool[i]);
+		av_frame_free(&pipe->yuv_pool[i]);
+	}
+	for (int i = 0; i < PIPELINE_PACKETS; i++) {
+		av_packet_free(&pipe->pkt_pool[i]);
+	}
+	int ret = pipe->error;
+	delete pipe;
+	s->pipe = nullptr;
+	return ret;
+}
+/* Next picture for the encoder. While none is ready the producers may go
+ * over the frame budget: the encoder releases the pictures it holds only
+ * as it is given more. */
+template <typename Ring>
+static bool pop_ready(Session *s, Ring *ring, AVFrame **f)
+{
+	if (ring->try_pop(f)) return true;
+	s->frame_budget.set_consumer_idle(true);
+	bool ready = ring->pop(f);
+	s->frame_budget.set_consumer_idle(false);
+	return ready;
+}
+static int write_video_frame(Session *s, AVStream *st, int flush)
 {
 	int ret;
-	static struct SwsContext *sws_ctx;
-	AVCodecContext *c = st->codec;
+	AVCodecContext *c = s->video_enc;
+	AVFrame *enc_frame = nullptr;
 	if (!flush) {
-		/* as we only generate a YUV420P picture, we must convert it
-		 * to the codec pixel format if needed */
-		if (!sws_ctx) {
-			sws_ctx = sws_getContext(c->width, c->height, AV_PIX_FMT_RGB24, c->width, c->height, c->pix_fmt, sws_flags, nullptr, nullptr, nullptr);
-			if (!sws_ctx) {
-				fprintf(stderr, "Could not initialize the conversion context\n");
-				exit(1);
+		if (s->pipe) {
+			Pipeline *pipe = s->pipe;
+			bool ready = pipe->nb_workers ? pop_ready(s, &pipe->workers[pipe->next_worker]->ready_ring, &enc_frame) : pop_ready(s, &pipe->yuv_ready_ring, &enc_frame);
+			if (!ready) {
+				ret = pipe->error;
+				return ret < 0 ? ret : AVERROR_EXIT;
 			}
+			if (live_mode && s->packet_budget.full()) {
+				/* storage is behind: skip this frame, the muxer records
+				 * the gap from the timestamps */
+				if (pipe->nb_workers) {
+					pipe->workers[pipe->next_worker]->free_ring.push(enc_frame);
+					pipe->next_worker = (pipe->next_worker + 1) % pipe->nb_workers;
+				} else {
+					pipe->yuv_free_ring.push(enc_frame);
+				}
+				s->dropped_frames++;
+				s->video_pts = s->frame_count;
+				s->frame_count++;
+				s->progress_frames.store(s->frame_count, std::memory_order_relaxed);
+				s->progress_dropped.store(s->dropped_frames, std::memory_order_relaxed);
+				return 0;
+			}
+		} else {
+			/* when we pass a frame to the encoder, it may keep a reference
+			 * to it internally; make sure we do not overwrite it here */
+			ret = make_picture_writable(s->frame);
+			if (ret < 0) return ret;
+			render_picture(s, s->tmp_frame, s->sws_ctx, s->frame, s->frame_count, c->width, c->height);
+			enc_frame = s->frame;
 		}
-		fill_rgb_image(&src_picture, frame_count, c->width, c->height);
-		sws_scale(sws_ctx, (const uint8_t * const *)src_picture.data, src_picture.linesize, 0, c->height, dst_picture.data, dst_picture.linesize);
-	}
-//	if (oc->oformat->flags & AVFMT_RAWPICTURE && !flush) {
-//		/* Raw video case - directly store the picture in the packet */
-//		AVPacket pkt;
-//		av_init_packet(&pkt);
-//		pkt.flags        |= AV_PKT_FLAG_KEY;
-//		pkt.stream_index  = st->index;
-//		pkt.data          = dst_picture.data[0];
-//		pkt.size          = sizeof(AVPicture);
-//		ret = av_interleaved_write_frame(oc, &pkt);
-//	} else
-	{
-		AVPacket pkt = {};
-		int got_packet;
-		av_init_packet(&pkt);
-		/* encode the image */
-		frame->pts = frame_count;
-		ret = avcodec_encode_video2(c, &pkt, flush ? nullptr : frame, &got_packet);
-		if (ret < 0) {
-//			fprintf(stderr, "Error encoding video frame: %s\n", av_err2str(ret));
-			exit(1);
-		}
-		/* If size is zero, it means the image was buffered. */
-		if (got_packet) {
-			ret = write_frame(oc, &c->time_base, st, &pkt);
+		enc_frame->pts = s->frame_count;
+		if (low_latency) s->push_ns[s->frame_count % LATENCY_SLOTS] = latency_clock();
+	}
+	/* encode the image */
+	ret = encode_frame(s, c, st, enc_frame, BENCH_VIDEO_ENCODE);
+	if (s->pipe && enc_frame) {
+		Pipeline *pipe = s->pipe;
+		if (pipe->nb_workers) {
+			pipe->workers[pipe->next_worker]->free_ring.push(enc_frame);
+			pipe->next_worker = (pipe->next_worker + 1) % pipe->nb_workers;
 		} else {
-			if (flush) {
-				video_is_eof = 1;
-			}
-			ret = 0;
+			pipe->yuv_free_ring.push(enc_frame);
 		}
 	}
 	if (ret < 0) {
-//		fprintf(stderr, "Error while writing video frame: %s\n", av_err2str(ret));
-		exit(1);
+		return ret;
 	}
-	video_pts = frame->pts;
-	frame_count++;
+	if (ret == 1) {
+		s->video_is_eof = 1;
+	}
+	s->video_pts = s->frame_count;
+	s->frame_count++;
+	s->progress_frames.store(s->frame_count, std::memory_order_relaxed);
+	return 0;
 }
-static void close_video(AVFormatContext *oc, AVStream *st)
+static void close_video(Session *s)
 {
-	(void)oc;
-	avcodec_close(st->codec);
-	av_free(src_picture.data[0]);
-	av_free(dst_picture.data[0]);
-	av_frame_free(&frame);
+	avcodec_free_context(&s->video_enc);
+	sws_freeContext(s->sws_ctx);
+	av_frame_free(&s->frame);
+	av_frame_free(&s->tmp_frame);
 }
 /**************************************************************/
 /* media file output */
-int main()
+
+/* -memprof: what the session's own buffers hold at the end, and the peaks
+ * of those that come and go. */
+static double buffer_mb(const AVFrame *f)
 {
-	const char *filename = "test.avi";
-	AVOutputFormat *fmt;
+	double size = 0;
+	for (int i = 0; f && i < AV_NUM_DATA_POINTERS && f->buf[i]; i++) {
+		size += f->buf[i]->size;
+	}
+	return size / 1048576;
+}
+static void report_buffers(Session *s)
+{
+	double samples = 0, fifo = 0;
+	if (s->audio_enc) {
+		AVCodecContext *c = s->audio_enc;
+		int nb_channels = c->ch_layout.nb_channels;
+		if (s->src_samples_data) samples += av_samples_get_buffer_size(nullptr, nb_channels, s->src_nb_samples, s->src_sample_fmt, 0);
+		if (s->rs_samples_data) samples += av_samples_get_buffer_size(nullptr, nb_channels, s->rs_max_nb_samples, c->sample_fmt, 0);
+		if (s->audio_fifo) {
+			fifo = (double)(av_audio_fifo_size(s->audio_fifo) + av_audio_fifo_space(s->audio_fifo)) * nb_channels * av_get_bytes_per_sample(c->sample_fmt);
+		}
+	}
+	printf("%s: buffers: dst picture %.2f MB, src picture %.2f MB, all pictures peak %.2f MB, "
+		"sample buffers %.2f MB, audio frame %.2f MB, audio fifo %.2f MB, "
+		"packets in flight peak %.2f MB, interleaving queue peak %.2f MB\n",
+		s->filename, buffer_mb(s->frame), buffer_mb(s->tmp_frame), s->frame_budget.peak() / 1048576.0,
+		samples / 1048576, buffer_mb(s->audio_frame), fifo / 1048576,
+		s->packet_budget.peak() / 1048576.0, s->mux_queued_peak / 1048576.0);
+}
+/* Encode one output file. Returns 0 or a negative AVERROR code; the caller
+ * releases the session with close_session() in either case. */
+static int encode_session(Session *s)
+{
+	const AVOutputFormat *fmt;
 	AVFormatContext *oc;
-	AVStream *audio_st, *video_st;
-	AVCodec *audio_codec, *video_codec;
+	AVStream *audio_st = nullptr, *video_st = nullptr;
 	double audio_time, video_time;
 	int flush, ret;
+	const char *filename = s->filename;
 
-//	av_log_set_level(AV_LOG_ERROR);
-	av_log_set_level(AV_LOG_WARNING);
-
-	/* Initialize libavcodec, and register all codecs and formats. */
-	av_register_all();
 	/* allocate the output media context */
-	avformat_alloc_output_context2(&oc, nullptr, nullptr, filename);
-	if (!oc) {
+	avformat_alloc_output_context2(&s->oc, nullptr, nullptr, filename);
+	if (!s->oc) {
 		printf("Could not deduce output format from file extension: using MPEG.\n");
-		avformat_alloc_output_context2(&oc, nullptr, "avi", filename);
+		avformat_alloc_output_context2(&s->oc, nullptr, "avi", filename);
 	}
-	if (!oc) return 1;
+	if (!s->oc) return AVERROR(ENOMEM);
+	oc = s->oc;
 //	oc->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
 	fmt = oc->oformat;
-	assert(fmt->audio_codec == AV_CODEC_ID_MP3);
-	assert(fmt->video_codec == AV_CODEC_ID_MPEG4);
+	if (fmt->video_codec != AV_CODEC_ID_MPEG4) {
+		fprintf(stderr, "%s: Output format '%s' is not AVI (MPEG-4 video)\n", filename, fmt->name);
+		return AVERROR(EINVAL);
+	}
 	/* Add the audio and video streams using the default format codecs
 	 * and initialize the codecs. */
-	video_st = nullptr;
-	audio_st = nullptr;
-	if (fmt->video_codec != AV_CODEC_ID_NONE) video_st = add_stream(oc, &video_codec, fmt->video_codec);
-	if (fmt->audio_codec != AV_CODEC_ID_NONE) audio_st = add_stream(oc, &audio_codec, fmt->audio_codec);
+	if (fmt->video_codec != AV_CODEC_ID_NONE) {
+		ret = add_stream(s, &video_st, &s->video_enc, &s->video_codec, fmt->video_codec, video_codec_name);
+		if (ret < 0) return ret;
+		s->video_st = video_st;
+	}
+	if (fmt->audio_codec != AV_CODEC_ID_NONE) {
+		ret = add_stream(s, &audio_st, &s->audio_enc, &s->audio_codec, audio_codec_entry->codec_id, nullptr);
+		if (ret < 0) return ret;
+		s->audio_st = audio_st;
+	}
 	/* Now that all the parameters are set, we can open the audio and
 	 * video codecs and allocate the necessary encode buffers. */
 	if (video_st) {
-		open_video(oc, video_codec, video_st);
-		video_st->time_base.den = 100 * STREAM_FRAME_RATE;
-		video_st->time_base.num = 100;
+		ret = open_video(s, s->video_codec, video_st);
+		if (ret < 0) return ret;
 	}
 	if (audio_st) {
-		open_audio(oc, audio_codec, audio_st);
+		ret = open_audio(s, s->audio_codec, audio_st);
+		if (ret < 0) return ret;
+	}
+	s->video_index = video_st ? video_st->index : -1;
+	s->audio_index = audio_st ? audio_st->index : -1;
+	if (video_st) s->gop_size = s->video_enc->gop_size;
+	if (audio_st) s->audio_sample_rate = s->audio_enc->sample_rate;
+	s->pkt = av_packet_alloc();
+	if (!s->pkt) return AVERROR(ENOMEM);
+	Checkpoint ck = {};
+	std::string resume_src = std::string(filename) + ".resume";
+	if (s->resume) {
+		ret = load_checkpoint(s, &ck);
+		if (ret < 0) {
+			fprintf(stderr, "%s: Could not read checkpoint '%s': %s\n", filename, s->checkpoint_path.c_str(), err2str(ret).c_str());
+			return ret;
+		}
+		/* keep the interrupted output as the source of the copy; if a
+		 * previous resume was interrupted it is still there */
+		if (!file_exists(resume_src.c_str()) && rename(filename, resume_src.c_str()) != 0) {
+			ret = AVERROR(errno);
+			fprintf(stderr, "%s: Could not move output aside: %s\n", filename, err2str(ret).c_str());
+			return ret;
+		}
 	}
 	av_dump_format(oc, 0, filename, 1);
 	/* open the output file, if needed */
 	if (!(fmt->flags & AVFMT_NOFILE)) {
-		ret = avio_open(&oc->pb, filename, AVIO_FLAG_WRITE);
+		if (manifest_enabled) {
+			std::string manifest_path = std::string(filename) + ".manifest";
+			ret = manifest_open(&s->manifest, filename, manifest_path.c_str(), &oc->pb);
+			oc->flags |= AVFMT_FLAG_CUSTOM_IO;
+		} else {
+			ret = avio_open(&oc->pb, filename, AVIO_FLAG_WRITE);
+		}
 		if (ret < 0) {
-//			fprintf(stderr, "Could not open '%s': %s\n", filename, av_err2str(ret));
-			return 1;
+			fprintf(stderr, "Could not open '%s': %s\n", filename, err2str(ret).c_str());
+			return ret;
 		}
 	}
+	if (low_latency) {
+		/* flush the AVIOContext after every packet */
+		oc->flush_packets = 1;
+	}
 	/* Write the stream header, if any. */
 	ret = avformat_write_header(oc, nullptr);
 	if (ret < 0) {
-//		fprintf(stderr, "Error occurred when opening output file: %s\n", av_err2str(ret));
-		return 1;
+		fprintf(stderr, "%s: Error occurred when opening output file: %s\n", filename, err2str(ret).c_str());
+		return ret;
+	}
+	s->header_written = true;
+	progress_add(s);
+	if (stats_enabled) {
+		/* the muxer may have changed the time bases in write_header */
+		int32_t time_base[MAX_STREAMS][2];
+		for (unsigned i = 0; i < oc->nb_streams && i < MAX_STREAMS; i++) {
+			time_base[i][0] = oc->streams[i]->time_base.num;
+			time_base[i][1] = oc->streams[i]->time_base.den;
+		}
+		std::string stats_path = std::string(filename) + ".stats";
+		ret = statslog_open(&s->stats, stats_path.c_str(), FFMIN((int)oc->nb_streams, MAX_STREAMS), time_base);
+		if (ret < 0) {
+			fprintf(stderr, "%s: Could not open '%s': %s\n", filename, stats_path.c_str(), err2str(ret).c_str());
+			return ret;
+		}
 	}
+	if (s->resume) {
+		ret = copy_checkpointed_packets(s, resume_src.c_str(), &ck);
+		if (ret < 0) {
+			fprintf(stderr, "%s: Could not copy '%s': %s\n", filename, resume_src.c_str(), err2str(ret).c_str());
+			return ret;
+		}
+		s->frame_count = ck.frame;
+		s->video_pts = s->frame_count;
+		if (audio_st) {
+			AVCodecContext *c = s->audio_enc;
+			s->samples_count = ck.audio_samples;
+			seek_audio_generator(s, av_rescale(s->samples_count, s->audio_src_rate, c->sample_rate));
+			s->audio_pts = (double)s->samples_count * audio_st->time_base.den / audio_st->time_base.num / c->sample_rate;
+		}
+		/* the new output now holds everything the checkpoint covers */
+		ret = save_checkpoint(s, ck.frame);
+		if (ret < 0) {
+			fprintf(stderr, "%s: Could not write checkpoint: %s\n", filename, err2str(ret).c_str());
+			return ret;
+		}
+		remove(resume_src.c_str());
+		printf("%s: Resuming at frame %d\n", filename, s->frame_count);
+	}
+	s->checkpoint_armed = checkpoint_enabled || s->resume;
 	flush = 0;
-	while ((video_st && !video_is_eof) || (audio_st && !audio_is_eof)) {
+	if (pipeline_enabled) {
+		ret = start_pipeline(s);
+		if (ret < 0) return ret;
+	}
+	while ((video_st && !s->video_is_eof) || (audio_st && !s->audio_is_eof)) {
 		/* Compute current audio and video time. */
-		audio_time = (audio_st && !audio_is_eof) ? audio_pts * av_q2d(audio_st->time_base) : INFINITY;
-		video_time = (video_st && !video_is_eof) ? video_pts * av_q2d(video_st->time_base) : INFINITY;
+		audio_time = (audio_st && !s->audio_is_eof) ? s->audio_pts * av_q2d(audio_st->time_base) : INFINITY;
+		video_time = (video_st && !s->video_is_eof) ? s->video_pts * av_q2d(video_st->time_base) : INFINITY;
 //		audio_time = (audio_st && !audio_is_eof) ? audio_st->pts.val * av_q2d(audio_st->time_base) : INFINITY;
 //		video_time = (video_st && !video_is_eof) ? video_st->pts.val * av_q2d(video_st->time_base) : INFINITY;
+		if (FFMIN(audio_time, video_time) < INFINITY) {
+			s->progress_media_us.store((int64_t)(FFMIN(audio_time, video_time) * 1e6), std::memory_order_relaxed);
+		}
 		if (!flush && (!audio_st || audio_time >= STREAM_DURATION) && (!video_st || video_time >= STREAM_DURATION)) {
 			flush = 1;
 		}
+		/* on cancellation, stop at the end of the current GOP */
+		if (!flush && cancel_requested && (!video_st || s->frame_count % s->gop_size == 0)) {
+			printf("%s: Cancelled, stopping at frame %d\n", filename, s->frame_count);
+			flush = 1;
+		}
 		/* write interleaved audio and video frames */
-		if (audio_st && !audio_is_eof && audio_time <= video_time) {
-			write_audio_frame(oc, audio_st, flush);
+		ret = 0;
+		if (audio_st && !s->audio_is_eof && audio_time <= video_time) {
+			ret = write_audio_frame(s, audio_st, flush);
 //			printf("A %f\n", audio_pts);
 //			putchar('A');
-		} else if (video_st && !video_is_eof && video_time < audio_time) {
-			write_video_frame(oc, video_st, flush);
+		} else if (video_st && !s->video_is_eof && video_time < audio_time) {
+			ret = write_video_frame(s, video_st, flush);
 //			printf("V %f\n", video_pts);
 //			putchar('V');
 		}
+		if (ret < 0) return ret;
 	}
 	/* Write the trailer, if any. The trailer must be written before you
-	 * close the CodecContexts open when you wrote the header; otherwise
+	 * free the codec contexts open when you wrote the header; otherwise
 	 * av_write_trailer() may try to use memory that was freed on
-	 * av_codec_close(). */
-	av_write_trailer(oc);
+	 * avcodec_free_context(). */
+	if (s->pipe) {
+		ret = stop_pipeline(s);
+		if (ret < 0) {
+			fprintf(stderr, "%s: Error while writing packets: %s\n", filename, err2str(ret).c_str());
+			return ret;
+		}
+	}
+	if (cancel_requested) {
+		/* the encoders were flushed, so the output ends on a GOP
+		 * boundary and the next run can continue from there */
+		s->checkpoint_armed = false;
+		if (save_checkpoint(s, s->frame_count) == 0) {
+			printf("%s: Checkpoint written to %s, rerun with -resume to continue\n", filename, s->checkpoint_path.c_str());
+		}
+	} else if (s->checkpoint_armed) {
+		remove(s->checkpoint_path.c_str());
+	}
+	ret = av_write_trailer(oc);
+	if (ret < 0) {
+		fprintf(stderr, "%s: Error writing trailer: %s\n", filename, err2str(ret).c_str());
+		return ret;
+	}
+	if (s->manifest) {
+		ret = manifest_finish(s->manifest);
+		if (ret < 0) {
+			fprintf(stderr, "%s: Could not complete the manifest: %s\n", filename, err2str(ret).c_str());
+			return ret;
+		}
+	}
+	if (frame_mem_limit || packet_mem_limit || live_mode) {
+		printf("%s: peak memory in flight: frames %.1f MB, packets %.1f MB", filename, s->frame_budget.peak() / 1048576.0, s->packet_budget.peak() / 1048576.0);
+		if (live_mode) printf(", %d video frames dropped", s->dropped_frames);
+		printf("\n");
+	}
+	if (s->stats) {
+		ret = statslog_close(&s->stats);
+		if (ret < 0) {
+			fprintf(stderr, "%s: Could not write the packet stats: %s\n", filename, err2str(ret).c_str());
+			return ret;
+		}
+	}
+	if (memprof_enabled) {
+		report_buffers(s);
+	}
+	if (!s->latency_us.empty()) {
+		std::vector<uint32_t> &lat = s->latency_us;
+		std::sort(lat.begin(), lat.end());
+		size_t n = lat.size();
+		printf("%s: frame latency p50 %.2f ms, p99 %.2f ms, max %.2f ms over %zu frames\n", filename, lat[(n - 1) / 2] / 1e3, lat[(n * 99 + 99) / 100 - 1] / 1e3, lat[n - 1] / 1e3, n);
+	}
+	return cancel_requested ? AVERROR_EXIT : 0;
+}
+/* Release everything a session holds, however far encode_session() got. */
+static void close_session(Session *s)
+{
+	progress_remove(s);
+	if (s->pipe) {
+		stop_pipeline(s);
+	}
 	/* Close each codec. */
-	if (video_st) {
-		close_video(oc, video_st);
+	close_video(s);
+	close_audio(s);
+	av_packet_free(&s->pkt);
+	statslog_close(&s->stats);
+	if (s->manifest) {
+		/* the manifest owns the output file */
+		manifest_free(&s->manifest);
+		if (s->oc) s->oc->pb = nullptr;
 	}
-	if (audio_st) {
-		close_audio(oc, audio_st);
+	if (s->oc) {
+		if (!(s->oc->oformat->flags & AVFMT_NOFILE)) {
+			/* Close the output file. */
+			avio_closep(&s->oc->pb);
+		}
+		/* free the stream */
+		avformat_free_context(s->oc);
+		s->oc = nullptr;
 	}
-	if (!(fmt->flags & AVFMT_NOFILE)) {
-		/* Close the output file. */
-		avio_close(oc->pb);
+}
+
+struct SessionResult {
+	int ret = 0;
+	int attempts = 0;
+	int frames = 0;
+	double media_seconds = 0;
+};
+
+/* Encode one output, retrying up to max_retries times. A retry continues
+ * from the last checkpoint when checkpoints are enabled. */
+static void run_session(const char *filename, SessionResult *result)
+{
+	for (int attempt = 0; ; attempt++) {
+		Session *s = new Session(filename);
+		s->resume = resume_enabled || (attempt > 0 && checkpoint_enabled && file_exists(s->checkpoint_path.c_str()));
+		int ret = encode_session(s);
+		result->attempts = attempt + 1;
+		result->ret = ret;
+		result->frames = s->frame_count;
+		if (s->video_st) {
+			result->media_seconds = s->video_pts * av_q2d(s->video_st->time_base);
+		} else if (s->audio_st) {
+			result->media_seconds = s->audio_pts * av_q2d(s->audio_st->time_base);
+		}
+		close_session(s);
+		delete s;
+		if (ret >= 0 || ret == AVERROR_EXIT || cancel_requested || attempt >= max_retries) {
+			return;
+		}
+		fprintf(stderr, "%s: retrying (%d of %d)\n", filename, attempt + 1, max_retries);
 	}
-	/* free the stream */
-	avformat_free_context(oc);
-	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -o FILE                         output file, may be repeated (default: test.avi)\n"
+		"  -jobs N                         number of outputs encoded concurrently\n"
+		"  -retry N                        retry a failed output up to N times\n"
+		"  -acodec mp3|aac|flac|pcm        audio codec\n"
+		"  -vcodec NAME                    video encoder (default: the format's, mpeg4 for AVI)\n"
+		"  -size WxH                       picture size, even (default: 1280x720)\n"
+		"  -tile-rows N                    generate and convert in tiles of N rows, 0: whole pictures\n"
+		"                                  (default: cache sized tiles from 3840x2160 up)\n"
+		"  -pix-fmt yuv420p|nv12|yuv422p|yuv444p|yuv420p10|p010\n"
+		"                                  encoder input format (default: yuv420p)\n"
+		"  -src-rate N                     generator sample rate (default: encoder rate)\n"
+		"  -resampler swr|soxr             rate conversion engine\n"
+		"  -resample-quality fast|medium|high\n"
+		"  -filter-size N                  resampler filter length (swr)\n"
+		"  -precision N                    resampler precision in bits (soxr)\n"
+		"  -progress SECONDS               progress line interval, 0: off (default: 1 on a terminal)\n"
+		"  -bench                          print per-stage CPU time at exit\n"
+		"  -perf                           per-stage cycles, instructions, LLC and branch misses (Linux; implies -bench)\n"
+		"  -memprof                        print peak memory and buffer sizes, and allocations per stage\n"
+		"                                  in a build with MEMPROF=1\n"
+		"  -pipeline                       run generation, conversion and muxing on their own threads\n"
+		"  -prefetch N                     render frames ahead of the encoder on N worker threads (implies -pipeline)\n"
+		"  -cpu scalar|sse4.1|avx2|avx512  force the kernel instruction set (default: best supported)\n"
+		"  -convert sws|native|fused       RGB to YUV conversion with libswscale or the internal kernels,\n"
+		"                                  or generate YUV420P directly without the RGB24 picture\n"
+		"  -manifest                       write packet and file CRC32C checksums to <output>.manifest\n"
+		"  -frame-mem MB                   budget for pictures in flight; pipeline depth is reduced to fit and\n"
+		"                                  the producers wait for the encoder (implies -pipeline)\n"
+		"  -packet-mem MB                  budget for encoded packets not yet written, including the muxer's\n"
+		"                                  interleaving queue; the encoder waits\n"
+		"                                  (implies -pipeline)\n"
+		"  -live                           drop video frames instead of waiting for storage, once the\n"
+		"                                  -packet-mem budget is used up (default 8 MB; implies -pipeline)\n"
+		"  -low-latency                    no B-frames or lookahead, slice threads, flush after every packet;\n"
+		"                                  reports the p99 delay from encoder input to packet written\n"
+		"  -slice-pool                     encode slices of all outputs on one pool of a thread per core instead\n"
+		"                                  of slice threads per output (for -jobs; MPEG video family and FFV1)\n"
+		"  -stats                          log every packet (stream, pts, dts, size, key, encode time) to\n"
+		"                                  <output>.stats, a binary log read by stats2csv\n"
+		"  -checkpoint                     record progress after every GOP in <output>.ckpt\n"
+		"  -resume                         continue an interrupted encode from its checkpoint\n"
+		, name);
+}
+int main(int argc, char **argv)
+{
+	std::vector<const char *> outputs;
+	int jobs = 1;
+	CpuLevel cpu_level = cpu_detect();
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			outputs.push_back(argv[++i]);
+		} else if (strcmp(argv[i], "-jobs") == 0 && i + 1 < argc) {
+			jobs = atoi(argv[++i]);
+			if (jobs < 1) jobs = 1;
+		} else if (strcmp(argv[i], "-retry") == 0 && i + 1 < argc) {
+			max_retries = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-acodec") == 0 && i + 1 < argc) {
+			const char *name = argv[++i];
+			audio_codec_entry = nullptr;
+			for (size_t j = 0; j < sizeof(audio_codecs) / sizeof(audio_codecs[0]); j++) {
+				if (strcmp(audio_codecs[j].name, name) == 0) {
+					audio_codec_entry = &audio_codecs[j];
+				}
+			}
+			if (!audio_codec_entry) {
+				fprintf(stderr, "Unknown audio codec '%s'\n", name);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-vcodec") == 0 && i + 1 < argc) {
+			video_codec_name = argv[++i];
+		} else if (strcmp(argv[i], "-size") == 0 && i + 1 < argc) {
+			const char *size = argv[++i];
+			if (sscanf(size, "%dx%d", &video_width, &video_height) != 2 ||
+				video_width < 2 || video_height < 2 || (video_width | video_height) & 1) {
+				fprintf(stderr, "Invalid picture size '%s'\n", size);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-tile-rows") == 0 && i + 1 < argc) {
+			tile_rows = atoi(argv[++i]);
+			if (tile_rows < 0 || tile_rows & 1) {
+				fprintf(stderr, "Tile height must be even\n");
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-pix-fmt") == 0 && i + 1 < argc) {
+			const char *name = argv[++i];
+			pix_fmt_entry = nullptr;
+			for (size_t j = 0; j < sizeof(pix_fmts) / sizeof(pix_fmts[0]); j++) {
+				if (strcmp(pix_fmts[j].name, name) == 0) {
+					pix_fmt_entry = &pix_fmts[j];
+				}
+			}
+			if (!pix_fmt_entry) {
+				fprintf(stderr, "Unknown pixel format '%s'\n", name);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-src-rate") == 0 && i + 1 < argc) {
+			resample.src_rate = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-resampler") == 0 && i + 1 < argc) {
+			resample.engine = argv[++i];
+			if (strcmp(resample.engine, "swr") != 0 && strcmp(resample.engine, "soxr") != 0) {
+				fprintf(stderr, "Unknown resampler '%s'\n", resample.engine);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-resample-quality") == 0 && i + 1 < argc) {
+			const char *name = argv[++i];
+			resample.preset = nullptr;
+			for (size_t j = 0; j < sizeof(resample_presets) / sizeof(resample_presets[0]); j++) {
+				if (strcmp(resample_presets[j].name, name) == 0) {
+					resample.preset = &resample_presets[j];
+				}
+			}
+			if (!resample.preset) {
+				fprintf(stderr, "Unknown resample quality '%s'\n", name);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-filter-size") == 0 && i + 1 < argc) {
+			resample.filter_size = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-precision") == 0 && i + 1 < argc) {
+			resample.precision = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-progress") == 0 && i + 1 < argc) {
+			progress_interval = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-bench") == 0) {
+			bench_enabled = true;
+		} else if (strcmp(argv[i], "-perf") == 0) {
+			perfcount_enabled = true;
+			bench_enabled = true;
+		} else if (strcmp(argv[i], "-memprof") == 0) {
+			memprof_enabled = true;
+		} else if (strcmp(argv[i], "-pipeline") == 0) {
+			pipeline_enabled = true;
+		} else if (strcmp(argv[i], "-prefetch") == 0 && i + 1 < argc) {
+			prefetch_workers = atoi(argv[++i]);
+			if (prefetch_workers < 1 || prefetch_workers > PREFETCH_MAX_WORKERS) {
+				fprintf(stderr, "Number of prefetch workers must be between 1 and %d\n", PREFETCH_MAX_WORKERS);
+				return 1;
+			}
+			pipeline_enabled = true;
+		} else if (strcmp(argv[i], "-cpu") == 0 && i + 1 < argc) {
+			const char *name = argv[++i];
+			if (!cpu_level_from_name(name, &cpu_level)) {
+				fprintf(stderr, "Unknown instruction set '%s'\n", name);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-convert") == 0 && i + 1 < argc) {
+			const char *name = argv[++i];
+			if (strcmp(name, "native") == 0) {
+				convert_mode = CONVERT_NATIVE;
+			} else if (strcmp(name, "fused") == 0) {
+				convert_mode = CONVERT_FUSED;
+			} else if (strcmp(name, "sws") == 0) {
+				convert_mode = CONVERT_SWS;
+			} else {
+				fprintf(stderr, "Unknown converter '%s'\n", name);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-frame-mem") == 0 && i + 1 < argc) {
+			frame_mem_limit = (int64_t)(atof(argv[++i]) * 1048576);
+			pipeline_enabled = true;
+		} else if (strcmp(argv[i], "-packet-mem") == 0 && i + 1 < argc) {
+			packet_mem_limit = (int64_t)(atof(argv[++i]) * 1048576);
+			pipeline_enabled = true;
+		} else if (strcmp(argv[i], "-live") == 0) {
+			live_mode = true;
+			pipeline_enabled = true;
+		} else if (strcmp(argv[i], "-low-latency") == 0) {
+			low_latency = true;
+		} else if (strcmp(argv[i], "-slice-pool") == 0) {
+			slice_pool = true;
+		} else if (strcmp(argv[i], "-manifest") == 0) {
+			manifest_enabled = true;
+		} else if (strcmp(argv[i], "-stats") == 0) {
+			stats_enabled = true;
+		} else if (strcmp(argv[i], "-checkpoint") == 0) {
+			checkpoint_enabled = true;
+		} else if (strcmp(argv[i], "-resume") == 0) {
+			resume_enabled = true;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (outputs.empty()) {
+		outputs.push_back("test.avi");
+	}
+	if (live_mode && !packet_mem_limit) {
+		packet_mem_limit = LIVE_PACKET_MEM;
+	}
+
+//	av_log_set_level(AV_LOG_ERROR);
+	av_log_set_level(AV_LOG_WARNING);
+
+	CpuLevel level = kernels_init(cpu_level);
+	if (level != cpu_level) {
+		fprintf(stderr, "%s is not supported by this CPU, using %s\n", cpu_level_name(cpu_level), cpu_level_name(level));
+	}
+	if (bench_enabled) {
+		printf("kernels: %s\n", cpu_level_name(level));
+	}
+
+	signal(SIGINT, on_cancel_signal);
+	signal(SIGTERM, on_cancel_signal);
+	bench_start();
+	if (perfcount_enabled && !perfcount_start()) {
+		perfcount_enabled = false;
+	}
+	if (memprof_enabled) {
+		memprof_start();
+	}
+	if (progress_interval < 0) {
+#ifdef _WIN32
+		progress_interval = 0;
+#else
+		progress_interval = isatty(STDERR_FILENO) ? 1 : 0;
+#endif
+	}
+	std::thread monitor;
+	if (progress_interval > 0) {
+		monitor = std::thread(progress_monitor);
+	}
+	/* each worker takes the next output until none are left */
+	std::vector<SessionResult> results(outputs.size());
+	std::atomic<size_t> next_output(0);
+	auto worker = [&]() {
+		size_t i;
+		while ((i = next_output++) < outputs.size()) {
+			run_session(outputs[i], &results[i]);
+		}
+	};
+	std::vector<std::thread> workers;
+	for (int i = 1; i < jobs && (size_t)i < outputs.size(); i++) {
+		workers.push_back(std::thread(worker));
+	}
+	worker();
+	for (std::thread &t : workers) {
+		t.join();
+	}
+	if (monitor.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(progress_lock);
+			progress_stop = true;
+		}
+		progress_wake.notify_all();
+		monitor.join();
+	}
+	int failed = 0, frames = 0;
+	double media_seconds = 0;
+	for (size_t i = 0; i < outputs.size(); i++) {
+		frames += results[i].frames;
+		media_seconds += results[i].media_seconds;
+		if (results[i].ret < 0 && results[i].ret != AVERROR_EXIT) {
+			fprintf(stderr, "%s: failed after %d attempt(s): %s\n", outputs[i], results[i].attempts, err2str(results[i].ret).c_str());
+			failed++;
+		}
+	}
+	if (bench_enabled) {
+		bench_report(stdout, frames, media_seconds);
+	}
+	if (perfcount_enabled) {
+		perfcount_report(stdout, frames);
+	}
+	if (memprof_enabled) {
+		memprof_report(stdout);
+	}
+	return failed ? 1 : 0;
 }
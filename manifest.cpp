@@ -0,0 +1,208 @@
+#include "manifest.h"
+#include "crc32c.h"
+#include "ringbuffer.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#define MANIFEST_PACKETS 64
+/* The output file is hashed in blocks so that a rewritten block can be
+ * rehashed on its own. */
+#define MANIFEST_BLOCK   (1 << 20)
+#define MANIFEST_IO_SIZE (64 * 1024)
+
+struct Manifest : CacheAligned {
+	SpscRing<AVPacket *, MANIFEST_PACKETS> free_ring, ready_ring;
+	AVPacket *pool[MANIFEST_PACKETS] = {};
+	std::thread thread;
+	FILE *fp = nullptr;
+	std::string filename;
+	/* output file */
+	AVIOContext *out = nullptr; /* the file itself */
+	AVIOContext *pb = nullptr;  /* hashing context given to the muxer */
+	int64_t pos = 0, size = 0;
+	std::vector<uint32_t> block_crc;
+	std::vector<bool> block_dirty; /* rewritten, hash from the file at the end */
+};
+
+static void print_ts(FILE *fp, int64_t ts)
+{
+	if (ts == AV_NOPTS_VALUE) {
+		fputs(" -", fp);
+	} else {
+		fprintf(fp, " %" PRId64, ts);
+	}
+}
+static void hash_packets(Manifest *m)
+{
+	AVPacket *pkt;
+	while (m->ready_ring.pop(&pkt)) {
+		uint32_t crc = crc32c(0, pkt->data, pkt->size);
+		fprintf(m->fp, "%d", pkt->stream_index);
+		print_ts(m->fp, pkt->pts);
+		print_ts(m->fp, pkt->dts);
+		fprintf(m->fp, " %d %c %08" PRIx32 "\n", pkt->size, (pkt->flags & AV_PKT_FLAG_KEY) ? 'K' : '-', crc);
+		av_packet_unref(pkt);
+		m->free_ring.push(pkt);
+	}
+}
+
+static void mark_dirty(Manifest *m, int64_t start, int64_t end)
+{
+	size_t last = (size_t)((end - 1) / MANIFEST_BLOCK);
+	if (m->block_dirty.size() <= last) {
+		m->block_crc.resize(last + 1, 0);
+		m->block_dirty.resize(last + 1, false);
+	}
+	for (size_t b = (size_t)(start / MANIFEST_BLOCK); b <= last; b++) {
+		m->block_dirty[b] = true;
+	}
+}
+/* Appended data extends the running CRC of its block; anything else
+ * (the muxer seeking back to patch sizes) marks the blocks dirty. */
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int write_hashed(void *opaque, const uint8_t *buf, int size)
+#else
+static int write_hashed(void *opaque, uint8_t *buf, int size)
+#endif
+{
+	Manifest *m = (Manifest *)opaque;
+	if (size <= 0) return 0;
+	if (m->pos != m->size) {
+		mark_dirty(m, FFMIN(m->pos, m->size), m->pos + size);
+	} else {
+		const uint8_t *p = buf;
+		int64_t pos = m->pos;
+		for (int left = size; left > 0;) {
+			size_t b = (size_t)(pos / MANIFEST_BLOCK);
+			int n = (int)FFMIN(left, (int64_t)(b + 1) * MANIFEST_BLOCK - pos);
+			if (m->block_crc.size() <= b) {
+				m->block_crc.resize(b + 1, 0);
+				m->block_dirty.resize(b + 1, false);
+			}
+			if (!m->block_dirty[b]) m->block_crc[b] = crc32c(m->block_crc[b], p, n);
+			p += n;
+			pos += n;
+			left -= n;
+		}
+	}
+	avio_write(m->out, buf, size);
+	if (m->out->error < 0) return m->out->error;
+	m->pos += size;
+	if (m->pos > m->size) m->size = m->pos;
+	return size;
+}
+static int64_t seek_hashed(void *opaque, int64_t offset, int whence)
+{
+	Manifest *m = (Manifest *)opaque;
+	if (whence & AVSEEK_SIZE) return m->size;
+	whence &= ~AVSEEK_FORCE;
+	if (whence == SEEK_CUR) offset += m->pos;
+	else if (whence == SEEK_END) offset += m->size;
+	int64_t ret = avio_seek(m->out, offset, SEEK_SET);
+	if (ret < 0) return ret;
+	m->pos = ret;
+	return ret;
+}
+
+int manifest_open(Manifest **pm, const char *filename, const char *path, AVIOContext **pb)
+{
+	Manifest *m = *pm = new Manifest;
+	m->filename = filename;
+	for (int i = 0; i < MANIFEST_PACKETS; i++) {
+		m->pool[i] = av_packet_alloc();
+		if (!m->pool[i]) return AVERROR(ENOMEM);
+		m->free_ring.push(m->pool[i]);
+	}
+	m->fp = fopen(path, "w");
+	if (!m->fp) return AVERROR(errno);
+	fprintf(m->fp, "# %s: stream pts dts size key crc32c per packet, then the whole file\n", filename);
+	int ret = avio_open(&m->out, filename, AVIO_FLAG_WRITE);
+	if (ret < 0) return ret;
+	uint8_t *buffer = (uint8_t *)av_malloc(MANIFEST_IO_SIZE);
+	if (!buffer) return AVERROR(ENOMEM);
+	m->pb = avio_alloc_context(buffer, MANIFEST_IO_SIZE, 1, m, nullptr, write_hashed, seek_hashed);
+	if (!m->pb) {
+		av_free(buffer);
+		return AVERROR(ENOMEM);
+	}
+	m->thread = std::thread(hash_packets, m);
+	*pb = m->pb;
+	return 0;
+}
+
+int manifest_add_packet(Manifest *m, const AVPacket *pkt)
+{
+	AVPacket *ref;
+	if (!m->free_ring.pop(&ref)) return AVERROR_EXIT;
+	int ret = av_packet_ref(ref, pkt);
+	if (ret < 0) {
+		m->free_ring.push(ref);
+		return ret;
+	}
+	return m->ready_ring.push(ref) ? 0 : AVERROR_EXIT;
+}
+
+int manifest_finish(Manifest *m)
+{
+	avio_flush(m->pb);
+	int ret = m->pb->error;
+	m->ready_ring.close();
+	if (m->thread.joinable()) m->thread.join();
+	if (ret < 0) return ret;
+	ret = avio_closep(&m->out);
+	if (ret < 0) return ret;
+	/* hash the rewritten blocks from the file */
+	AVIOContext *in = nullptr;
+	std::vector<uint8_t> block;
+	size_t nb_blocks = (size_t)((m->size + MANIFEST_BLOCK - 1) / MANIFEST_BLOCK);
+	uint32_t crc = 0;
+	for (size_t b = 0; b < nb_blocks; b++) {
+		int len = (int)FFMIN((int64_t)MANIFEST_BLOCK, m->size - (int64_t)b * MANIFEST_BLOCK);
+		if (m->block_dirty[b]) {
+			if (!in) {
+				ret = avio_open(&in, m->filename.c_str(), AVIO_FLAG_READ);
+				if (ret < 0) return ret;
+				block.resize(MANIFEST_BLOCK);
+			}
+			avio_seek(in, (int64_t)b * MANIFEST_BLOCK, SEEK_SET);
+			if (avio_read(in, block.data(), len) != len) {
+				avio_closep(&in);
+				return AVERROR(EIO);
+			}
+			m->block_crc[b] = crc32c(0, block.data(), len);
+		}
+		crc = crc32c_combine(crc, m->block_crc[b], len);
+	}
+	avio_closep(&in);
+	fprintf(m->fp, "file %" PRId64 " %08" PRIx32 "\n", m->size, crc);
+	ret = fclose(m->fp) == 0 ? 0 : AVERROR(errno);
+	m->fp = nullptr;
+	return ret;
+}
+
+void manifest_free(Manifest **pm)
+{
+	Manifest *m = *pm;
+	if (!m) return;
+	m->free_ring.close();
+	m->ready_ring.close();
+	if (m->thread.joinable()) m->thread.join();
+	for (int i = 0; i < MANIFEST_PACKETS; i++) {
+		av_packet_free(&m->pool[i]);
+	}
+	if (m->fp) fclose(m->fp);
+	if (m->pb) {
+		av_freep(&m->pb->buffer);
+		avio_context_free(&m->pb);
+	}
+	avio_closep(&m->out);
+	delete m;
+	*pm = nullptr;
+}
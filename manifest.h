@@ -0,0 +1,32 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct AVIOContext;
+struct AVPacket;
+
+/* Integrity manifest of one output file, written next to it as text:
+ * the CRC32C of every packet (stream, pts, dts, size, key flag), hashed
+ * on a side thread while muxing goes on, and the CRC32C of the whole
+ * file once the trailer is written. The file is hashed as the muxer
+ * writes it; only the blocks it rewrites later (header fields patched at
+ * the trailer) are read back, so verification needs no second pass over
+ * the data. */
+struct Manifest;
+
+/* Open 'filename' for writing behind a hashing AVIOContext, returned in
+ * *pb and owned by the manifest, and start the manifest in 'path'. */
+int manifest_open(Manifest **pm, const char *filename, const char *path, AVIOContext **pb);
+/* Queue a reference to pkt for hashing. Call before handing the packet
+ * to the muxer, from one thread at a time. */
+int manifest_add_packet(Manifest *m, const AVPacket *pkt);
+/* After av_write_trailer(): wait for the packet hashes, close the output
+ * file and write the whole-file line. */
+int manifest_finish(Manifest *m);
+/* Stop the side thread and close everything, including the output file
+ * and its AVIOContext. */
+void manifest_free(Manifest **pm);
+
+#endif
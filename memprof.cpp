@@ -0,0 +1,142 @@
+#include "memprof.h"
+#include "bench.h"
+#include <atomic>
+#include <errno.h>
+#include <stdlib.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+#if defined(__GLIBC__) && defined(MEMPROF_HOOKS)
+#include <malloc.h>
+#define HAVE_MALLOC_HOOKS 1
+#endif
+
+bool memprof_enabled = false;
+thread_local int memprof_stage = BENCH_STAGE_COUNT;
+
+#define MEMPROF_SLOTS (BENCH_STAGE_COUNT + 1) /* the stages and "other" */
+
+static std::atomic<uint64_t> alloc_count[MEMPROF_SLOTS];
+static std::atomic<uint64_t> alloc_bytes[MEMPROF_SLOTS];
+static std::atomic<uint64_t> free_count[MEMPROF_SLOTS];
+/* heap held since memprof_start(); blocks from before are freed against
+ * it too, so it is a difference, not an absolute figure */
+static std::atomic<int64_t> heap_used, heap_peak;
+
+void memprof_start()
+{
+	for (int i = 0; i < MEMPROF_SLOTS; i++) {
+		alloc_count[i] = 0;
+		alloc_bytes[i] = 0;
+		free_count[i] = 0;
+	}
+	heap_used = 0;
+	heap_peak = 0;
+	memprof_enabled = true;
+}
+
+#ifdef HAVE_MALLOC_HOOKS
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t align, size_t size);
+void __libc_free(void *p);
+}
+
+static void count_alloc(void *p)
+{
+	if (!p) return;
+	int64_t n = malloc_usable_size(p);
+	int slot = memprof_stage;
+	alloc_count[slot].fetch_add(1, std::memory_order_relaxed);
+	alloc_bytes[slot].fetch_add(n, std::memory_order_relaxed);
+	int64_t used = heap_used.fetch_add(n, std::memory_order_relaxed) + n;
+	int64_t peak = heap_peak.load(std::memory_order_relaxed);
+	while (used > peak && !heap_peak.compare_exchange_weak(peak, used, std::memory_order_relaxed)) {
+	}
+}
+static void count_free(int64_t n)
+{
+	free_count[memprof_stage].fetch_add(1, std::memory_order_relaxed);
+	heap_used.fetch_sub(n, std::memory_order_relaxed);
+}
+
+/* Without -memprof each wrapper is one test and a tail call into libc. */
+extern "C" void *malloc(size_t size)
+{
+	if (!memprof_enabled) return __libc_malloc(size);
+	void *p = __libc_malloc(size);
+	count_alloc(p);
+	return p;
+}
+extern "C" void *calloc(size_t n, size_t size)
+{
+	if (!memprof_enabled) return __libc_calloc(n, size);
+	void *p = __libc_calloc(n, size);
+	count_alloc(p);
+	return p;
+}
+extern "C" void *realloc(void *old, size_t size)
+{
+	if (!memprof_enabled) return __libc_realloc(old, size);
+	int64_t before = old ? malloc_usable_size(old) : 0;
+	void *p = __libc_realloc(old, size);
+	/* on failure the old block stays */
+	if (p || !size) {
+		if (old) count_free(before);
+		count_alloc(p);
+	}
+	return p;
+}
+extern "C" void free(void *p)
+{
+	if (!memprof_enabled) return __libc_free(p);
+	if (p) count_free(malloc_usable_size(p));
+	__libc_free(p);
+}
+extern "C" void *memalign(size_t align, size_t size)
+{
+	if (!memprof_enabled) return __libc_memalign(align, size);
+	void *p = __libc_memalign(align, size);
+	count_alloc(p);
+	return p;
+}
+extern "C" void *aligned_alloc(size_t align, size_t size)
+{
+	return memalign(align, size);
+}
+extern "C" int posix_memalign(void **out, size_t align, size_t size)
+{
+	if (align < sizeof(void *) || (align & (align - 1))) return EINVAL;
+	void *p = memalign(align, size);
+	if (!p) return ENOMEM;
+	*out = p;
+	return 0;
+}
+#endif
+
+void memprof_report(FILE *fp)
+{
+#ifndef _WIN32
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) == 0) {
+		/* kilobytes on Linux, bytes on macOS */
+#ifdef __APPLE__
+		fprintf(fp, "peak RSS %.1f MB\n", ru.ru_maxrss / 1048576.0);
+#else
+		fprintf(fp, "peak RSS %.1f MB\n", ru.ru_maxrss / 1024.0);
+#endif
+	}
+#endif
+#ifdef HAVE_MALLOC_HOOKS
+	fprintf(fp, "heap peak %.1f MB above start, %.1f MB still held\n", heap_peak / 1048576.0, heap_used / 1048576.0);
+	fprintf(fp, "%-16s %10s %10s %10s\n", "stage", "allocs", "alloc MB", "frees");
+	for (int i = 0; i < MEMPROF_SLOTS; i++) {
+		if (!alloc_count[i] && !free_count[i]) continue;
+		fprintf(fp, "%-16s %10llu %10.1f %10llu\n", bench_stage_name(i), (unsigned long long)alloc_count[i], alloc_bytes[i] / 1048576.0, (unsigned long long)free_count[i]);
+	}
+#elif defined(__GLIBC__)
+	fprintf(fp, "heap not counted: build with MEMPROF=1 (qmake CONFIG+=memprof)\n");
+#endif
+}
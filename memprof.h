@@ -0,0 +1,23 @@
+#ifndef MEMPROF_H
+#define MEMPROF_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Heap profiling for -memprof. In a build with MEMPROF_HOOKS defined
+ * (make MEMPROF=1) and glibc, the malloc family is replaced by counting
+ * wrappers around the libc allocator, which also catches av_malloc()
+ * (posix_memalign underneath) and the buffers of the encoders and the
+ * muxer; FFmpeg has no allocator hook of its own. Allocations are charged
+ * to the bench stage the calling thread is in (bench_begin), the rest to
+ * "other". The wrappers replace the allocator of the whole process, so
+ * they are left out of normal builds; there only the peak RSS is
+ * reported. */
+extern bool memprof_enabled;
+/* current BenchStage of this thread, BENCH_STAGE_COUNT outside of one */
+extern thread_local int memprof_stage;
+
+void memprof_start();
+void memprof_report(FILE *fp);
+
+#endif
@@ -0,0 +1,189 @@
+#include "perfcount.h"
+#include "bench.h"
+#include <atomic>
+#include <errno.h>
+#include <string.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+bool perfcount_enabled = false;
+
+static const char *event_names[PERF_EVENT_COUNT] = {
+	"cycles",
+	"instructions",
+	"LLC misses",
+	"branch misses",
+};
+static std::atomic<uint64_t> stage_counts[BENCH_STAGE_COUNT][PERF_EVENT_COUNT];
+static std::atomic<uint64_t> stage_calls[BENCH_STAGE_COUNT];
+static std::atomic<int> available[PERF_EVENT_COUNT]; /* opened on some thread */
+
+#ifdef __linux__
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} events[PERF_EVENT_COUNT] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+/* One group per thread, read with a single read() of the leader. */
+struct CounterGroup {
+	int fd[PERF_EVENT_COUNT];
+	int slot[PERF_EVENT_COUNT]; /* position in the group read, -1: missing */
+	int error[PERF_EVENT_COUNT]; /* errno of the events that did not open */
+	int leader = -1;
+	int nb = 0;
+	bool opened = false;
+	uint64_t start[PERF_EVENT_COUNT];
+	uint64_t start_enabled = 0, start_running = 0;
+	CounterGroup()
+	{
+		for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+			fd[i] = -1;
+			slot[i] = -1;
+			error[i] = 0;
+		}
+	}
+	~CounterGroup()
+	{
+		for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+			if (fd[i] >= 0) close(fd[i]);
+		}
+	}
+};
+static thread_local CounterGroup group;
+
+static int open_event(int i, int group_fd)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[i].type;
+	attr.config = events[i].config;
+	/* user space only, which is what an unprivileged process may count */
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+/* The first event that opens leads the group. */
+static void open_group(CounterGroup *g)
+{
+	g->opened = true;
+	for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+		g->fd[i] = open_event(i, g->leader);
+		if (g->fd[i] < 0) {
+			g->error[i] = errno;
+			continue;
+		}
+		if (g->leader < 0) g->leader = g->fd[i];
+		g->slot[i] = g->nb++;
+		available[i] = 1;
+	}
+}
+static bool read_group(CounterGroup *g, uint64_t *values, uint64_t *enabled, uint64_t *running)
+{
+	uint64_t buf[3 + PERF_EVENT_COUNT];
+	if (read(g->leader, buf, sizeof(buf)) < (ssize_t)((3 + g->nb) * sizeof(uint64_t))) return false;
+	*enabled = buf[1];
+	*running = buf[2];
+	for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+		values[i] = g->slot[i] >= 0 ? buf[3 + g->slot[i]] : 0;
+	}
+	return true;
+}
+
+bool perfcount_start()
+{
+	for (int s = 0; s < BENCH_STAGE_COUNT; s++) {
+		for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+			stage_counts[s][i] = 0;
+		}
+		stage_calls[s] = 0;
+	}
+	open_group(&group);
+	if (group.leader < 0) {
+		int err = group.error[0];
+		fprintf(stderr, "perf counters unavailable: %s%s\n", strerror(err), err == EACCES || err == EPERM ? " (see /proc/sys/kernel/perf_event_paranoid)" : "");
+		return false;
+	}
+	for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+		if (group.slot[i] < 0) fprintf(stderr, "perf counter '%s' unavailable: %s\n", event_names[i], strerror(group.error[i]));
+	}
+	return true;
+}
+void perfcount_begin()
+{
+	CounterGroup *g = &group;
+	if (!g->opened) open_group(g);
+	if (g->leader < 0) return;
+	if (!read_group(g, g->start, &g->start_enabled, &g->start_running)) g->start_enabled = UINT64_MAX;
+}
+void perfcount_end(int stage, int calls)
+{
+	CounterGroup *g = &group;
+	uint64_t values[PERF_EVENT_COUNT], enabled, running;
+	if (g->leader < 0 || g->start_enabled == UINT64_MAX) return;
+	if (!read_group(g, values, &enabled, &running)) return;
+	/* scale up if the group shared the PMU with other events */
+	double scale = 1;
+	if (running > g->start_running && running - g->start_running < enabled - g->start_enabled) {
+		scale = (double)(enabled - g->start_enabled) / (running - g->start_running);
+	}
+	for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+		stage_counts[stage][i].fetch_add((uint64_t)((values[i] - g->start[i]) * scale), std::memory_order_relaxed);
+	}
+	stage_calls[stage].fetch_add(calls, std::memory_order_relaxed);
+}
+#else
+bool perfcount_start()
+{
+	fprintf(stderr, "perf counters are only supported on Linux\n");
+	return false;
+}
+void perfcount_begin()
+{
+}
+void perfcount_end(int stage, int calls)
+{
+	(void)stage;
+	(void)calls;
+}
+#endif
+
+static void print_mpki(FILE *fp, int event, uint64_t count, uint64_t instructions)
+{
+	if (!available[event] || !available[PERF_INSTRUCTIONS]) {
+		fprintf(fp, " %9s", "-");
+	} else {
+		fprintf(fp, " %9.2f", instructions ? count * 1000.0 / instructions : 0.0);
+	}
+}
+void perfcount_report(FILE *fp, int frames)
+{
+	fprintf(fp, "%-16s %10s %10s %6s %9s %9s %12s\n", "stage", "Mcycles", "Minstr", "IPC", "LLC MPKI", "br MPKI", "cycles/frame");
+	for (int s = 0; s < BENCH_STAGE_COUNT; s++) {
+		if (!stage_calls[s]) continue;
+		uint64_t cycles = stage_counts[s][PERF_CYCLES];
+		uint64_t instr = stage_counts[s][PERF_INSTRUCTIONS];
+		fprintf(fp, "%-16s", bench_stage_name(s));
+		if (available[PERF_CYCLES]) fprintf(fp, " %10.1f", cycles / 1e6);
+		else fprintf(fp, " %10s", "-");
+		if (available[PERF_INSTRUCTIONS]) fprintf(fp, " %10.1f", instr / 1e6);
+		else fprintf(fp, " %10s", "-");
+		if (available[PERF_CYCLES] && available[PERF_INSTRUCTIONS] && cycles) fprintf(fp, " %6.2f", (double)instr / cycles);
+		else fprintf(fp, " %6s", "-");
+		print_mpki(fp, PERF_LLC_MISSES, stage_counts[s][PERF_LLC_MISSES], instr);
+		print_mpki(fp, PERF_BRANCH_MISSES, stage_counts[s][PERF_BRANCH_MISSES], instr);
+		if (available[PERF_CYCLES] && frames > 0) fprintf(fp, " %12.0f", (double)cycles / frames);
+		else fprintf(fp, " %12s", "-");
+		fputc('\n', fp);
+	}
+}
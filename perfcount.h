@@ -0,0 +1,28 @@
+#ifndef PERFCOUNT_H
+#define PERFCOUNT_H
+
+#include <stdio.h>
+
+/* Hardware counters per bench stage (-perf), read with perf_event_open()
+ * on Linux: cycles, instructions, last level cache misses and branch
+ * misses of the calling thread between bench_begin() and bench_end().
+ * Each thread opens its own counter group the first time it enters a
+ * stage. Counters the CPU or the kernel do not provide are reported as
+ * missing; the others still count. */
+enum PerfEvent {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_LLC_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_EVENT_COUNT
+};
+
+extern bool perfcount_enabled;
+
+/* Check that counters can be opened; prints why not and returns false. */
+bool perfcount_start();
+void perfcount_begin();
+void perfcount_end(int stage, int calls);
+void perfcount_report(FILE *fp, int frames);
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <atomic>
+#include <stdint.h>
+#include "alignedmem.h"
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <thread>
+#endif
+
+/* Block until *addr no longer holds 'expected' (or a spurious wakeup). */
+static inline void ring_wait(std::atomic<uint32_t> *addr, uint32_t expected)
+{
+#ifdef __linux__
+	syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#else
+	while (addr->load() == expected) {
+		std::this_thread::yield();
+	}
+#endif
+}
+static inline void ring_wake(std::atomic<uint32_t> *addr)
+{
+#ifdef __linux__
+	syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+#else
+	(void)addr;
+#endif
+}
+
+/* Lock-free single producer / single consumer ring of N slots, N a power of
+ * two. It is meant to carry pointers to preallocated objects (AVFrame,
+ * AVPacket) between pipeline stages, typically as a pair of rings: one
+ * carrying filled objects downstream and one returning empty ones.
+ *
+ * The producer index, the consumer index and every slot sit on their own
+ * cache line. Each side keeps a private copy of the other side's index and
+ * only rereads the shared one when the ring looks full/empty. A blocked
+ * side sleeps on a futex and is only woken (a syscall) when it announced
+ * that it is waiting. A batch (push_n/pop_n) moves with one index update
+ * and at most one wakeup.
+ *
+ * Rings allocated with new are aligned by the class allocator; a struct
+ * embedding rings needs the same operator new (derive from CacheAligned). */
+template <typename T, unsigned N> class SpscRing : public CacheAligned {
+	static_assert(N >= 2 && (N & (N - 1)) == 0, "ring size must be a power of two");
+private:
+	struct alignas(CACHE_LINE_SIZE) Slot {
+		T value;
+	};
+	/* producer side */
+	alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> head_;
+	uint32_t tail_cache_;
+	/* consumer side */
+	alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> tail_;
+	uint32_t head_cache_;
+	/* blocking state: event counters used as futex words */
+	alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> push_event_;
+	std::atomic<uint32_t> consumer_waiting_;
+	alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> pop_event_;
+	std::atomic<uint32_t> producer_waiting_;
+	std::atomic<uint32_t> closed_;
+	Slot slots_[N];
+
+	void notify_consumer()
+	{
+		if (consumer_waiting_.load()) {
+			push_event_.fetch_add(1);
+			ring_wake(&push_event_);
+		}
+	}
+	void notify_producer()
+	{
+		if (producer_waiting_.load()) {
+			pop_event_.fetch_add(1);
+			ring_wake(&pop_event_);
+		}
+	}
+public:
+	SpscRing()
+		: head_(0)
+		, tail_cache_(0)
+		, tail_(0)
+		, head_cache_(0)
+		, push_event_(0)
+		, consumer_waiting_(0)
+		, pop_event_(0)
+		, producer_waiting_(0)
+		, closed_(0)
+	{
+	}
+	SpscRing(SpscRing const &) = delete;
+	SpscRing &operator = (SpscRing const &) = delete;
+	/* Push up to n items without blocking; returns the number pushed.
+	 * The consumer is told once for the whole batch. */
+	unsigned try_push_n(T const *items, unsigned n)
+	{
+		uint32_t head = head_.load(std::memory_order_relaxed);
+		if (N - (head - tail_cache_) < n) {
+			tail_cache_ = tail_.load(std::memory_order_acquire);
+		}
+		unsigned room = N - (head - tail_cache_);
+		if (n > room) n = room;
+		if (n == 0) return 0;
+		for (unsigned i = 0; i < n; i++) {
+			slots_[(head + i) & (N - 1)].value = items[i];
+		}
+		head_.store(head + n, std::memory_order_seq_cst);
+		notify_consumer();
+		return n;
+	}
+	/* Pop up to max items without blocking; returns the number popped. */
+	unsigned try_pop_n(T *items, unsigned max)
+	{
+		uint32_t tail = tail_.load(std::memory_order_relaxed);
+		if (head_cache_ - tail < max) {
+			head_cache_ = head_.load(std::memory_order_acquire);
+		}
+		unsigned avail = head_cache_ - tail;
+		if (max > avail) max = avail;
+		if (max == 0) return 0;
+		for (unsigned i = 0; i < max; i++) {
+			items[i] = slots_[(tail + i) & (N - 1)].value;
+		}
+		tail_.store(tail + max, std::memory_order_seq_cst);
+		notify_producer();
+		return max;
+	}
+	/* Push all n items, sleeping while the ring is full. Returns fewer
+	 * than n only if the ring was closed. */
+	unsigned push_n(T const *items, unsigned n)
+	{
+		unsigned done = 0;
+		while (done < n && !closed_.load(std::memory_order_relaxed)) {
+			unsigned k = try_push_n(items + done, n - done);
+			done += k;
+			if (k > 0) continue;
+			uint32_t ev = pop_event_.load();
+			producer_waiting_.store(1);
+			if (closed_.load()) {
+				producer_waiting_.store(0);
+				break;
+			}
+			if (head_.load(std::memory_order_relaxed) - tail_.load() == N) {
+				ring_wait(&pop_event_, ev);
+			}
+			producer_waiting_.store(0);
+		}
+		return done;
+	}
+	/* Pop between 1 and max items, sleeping while the ring is empty.
+	 * Returns 0 once the ring is closed and drained. */
+	unsigned pop_n(T *items, unsigned max)
+	{
+		while (1) {
+			unsigned k = try_pop_n(items, max);
+			if (k > 0) return k;
+			uint32_t ev = push_event_.load();
+			consumer_waiting_.store(1);
+			if (head_.load() == tail_.load(std::memory_order_relaxed)) {
+				if (closed_.load()) {
+					consumer_waiting_.store(0);
+					return 0;
+				}
+				ring_wait(&push_event_, ev);
+			}
+			consumer_waiting_.store(0);
+		}
+	}
+	bool try_push(T const &item)
+	{
+		return try_push_n(&item, 1) == 1;
+	}
+	bool try_pop(T *item)
+	{
+		return try_pop_n(item, 1) == 1;
+	}
+	bool push(T const &item)
+	{
+		return push_n(&item, 1) == 1;
+	}
+	bool pop(T *item)
+	{
+		return pop_n(item, 1) == 1;
+	}
+	/* Wake both sides; push fails from now on and pop fails once empty. */
+	void close()
+	{
+		closed_.store(1);
+		push_event_.fetch_add(1);
+		ring_wake(&push_event_);
+		pop_event_.fetch_add(1);
+		ring_wake(&pop_event_);
+	}
+};
+
+#endif
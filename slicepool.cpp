@@ -0,0 +1,154 @@
+#include "slicepool.h"
+#include "bench.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+/* One execute/execute2 call. Workers join it while it is at the head of
+ * the queue, each with its own slot (the threadnr of execute2), and take
+ * jobs until none are left. Everything is under the pool lock; the jobs
+ * are whole slices, so the lock is cold. */
+struct SliceBatch {
+	AVCodecContext *c;
+	int (*func)(AVCodecContext *c2, void *arg);
+	int (*func2)(AVCodecContext *c2, void *arg, int jobnr, int threadnr);
+	char *arg;
+	int *ret;
+	int count;
+	int size;
+	int max_slots;
+	int slots = 0;
+	int next_job = 0;
+	int finished = 0;
+	bool queued = true;
+	std::condition_variable done;
+};
+
+struct SlicePool {
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<SliceBatch *> queue;
+	std::vector<std::thread> threads;
+	bool stop = false;
+	~SlicePool()
+	{
+		{
+			std::lock_guard<std::mutex> l(lock);
+			stop = true;
+		}
+		wake.notify_all();
+		for (std::thread &t : threads) {
+			t.join();
+		}
+	}
+};
+
+static SlicePool pool;
+static std::once_flag pool_once;
+
+static void run_job(SliceBatch *b, int job, int slot)
+{
+	int r;
+	if (b->func2) {
+		r = b->func2(b->c, b->arg, job, slot);
+	} else {
+		r = b->func(b->c, b->arg + (size_t)job * b->size);
+	}
+	if (b->ret) b->ret[job] = r;
+}
+/* b is at the head of the queue while it is queued: batches are only added
+ * at the back and each leaves from the front. */
+static void dequeue(SliceBatch *b)
+{
+	if (b->queued) {
+		pool.queue.pop_front();
+		b->queued = false;
+	}
+}
+static void worker()
+{
+	std::unique_lock<std::mutex> l(pool.lock);
+	while (!pool.stop) {
+		if (pool.queue.empty()) {
+			pool.wake.wait(l);
+			continue;
+		}
+		SliceBatch *b = pool.queue.front();
+		int slot = b->slots++;
+		if (b->slots == b->max_slots) dequeue(b);
+		while (b->next_job < b->count) {
+			int job = b->next_job++;
+			if (b->next_job == b->count) dequeue(b);
+			l.unlock();
+			uint64_t t0 = bench_help_begin(BENCH_VIDEO_ENCODE);
+			run_job(b, job, slot);
+			bench_help_end(BENCH_VIDEO_ENCODE, t0);
+			l.lock();
+			if (++b->finished == b->count) b->done.notify_one();
+		}
+	}
+}
+static void start_pool()
+{
+	int n = (int)std::thread::hardware_concurrency();
+	for (int i = 0; i < (n > 0 ? n : 1); i++) {
+		pool.threads.push_back(std::thread(worker));
+	}
+}
+
+int slicepool_size()
+{
+	std::call_once(pool_once, start_pool);
+	return (int)pool.threads.size();
+}
+
+static void run_batch(SliceBatch *b)
+{
+	if (b->count == 1) {
+		run_job(b, 0, 0);
+		return;
+	}
+	std::call_once(pool_once, start_pool);
+	std::unique_lock<std::mutex> l(pool.lock);
+	pool.queue.push_back(b);
+	pool.wake.notify_all();
+	b->done.wait(l, [b] { return b->finished == b->count; });
+}
+
+int slicepool_execute(AVCodecContext *c, int (*func)(AVCodecContext *c2, void *arg), void *arg, int *ret, int count, int size)
+{
+	if (count <= 0) return 0;
+	SliceBatch b;
+	b.c = c;
+	b.func = func;
+	b.func2 = nullptr;
+	b.arg = (char *)arg;
+	b.ret = ret;
+	b.count = count;
+	b.size = size;
+	b.max_slots = count;
+	run_batch(&b);
+	return 0;
+}
+
+int slicepool_execute2(AVCodecContext *c, int (*func)(AVCodecContext *c2, void *arg, int jobnr, int threadnr), void *arg, int *ret, int count)
+{
+	if (count <= 0) return 0;
+	SliceBatch b;
+	b.c = c;
+	b.func = nullptr;
+	b.func2 = func;
+	b.arg = (char *)arg;
+	b.ret = ret;
+	b.count = count;
+	b.size = 0;
+	/* per-thread encoder state exists for thread_count threads */
+	b.max_slots = c->thread_count > 0 ? c->thread_count : 1;
+	run_batch(&b);
+	return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef SLICEPOOL_H
+#define SLICEPOOL_H
+
+struct AVCodecContext;
+
+/* One process-wide pool of worker threads, one per core, running the slice
+ * jobs of every video encoder (-slice-pool) instead of a thread set per
+ * codec context. The callbacks go into AVCodecContext.execute/execute2
+ * before avcodec_open2(), with thread_count = 1 so that libavcodec starts
+ * no threads of its own (its slice threading would replace the callbacks)
+ * and slices = slicepool_size() so that encoders which take their slice
+ * count from there (the MPEG video family, FFV1) split each picture into
+ * that many jobs.
+ *
+ * The calling thread only waits. execute2 jobs get a threadnr below the
+ * context's thread_count, unique among the jobs running at once. The
+ * workers' CPU time and counters go to the video encode bench stage. */
+int slicepool_size();
+int slicepool_execute(AVCodecContext *c, int (*func)(AVCodecContext *c2, void *arg), void *arg, int *ret, int count, int size);
+int slicepool_execute2(AVCodecContext *c, int (*func)(AVCodecContext *c2, void *arg, int jobnr, int threadnr), void *arg, int *ret, int count);
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ * stats2csv: convert the binary packet log written with -stats
+ * (<output>.stats) to CSV, one line per packet.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "statslog.h"
+
+static void print_ts(FILE *out, int64_t ts, const int32_t *tb)
+{
+	if (ts == INT64_MIN) {
+		fputs(",,", out);
+	} else if (tb[1]) {
+		fprintf(out, ",%" PRId64 ",%.6f", ts, (double)ts * tb[0] / tb[1]);
+	} else {
+		fprintf(out, ",%" PRId64 ",", ts);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s FILE.stats [OUT.csv]\n", argv[0]);
+		return 2;
+	}
+	FILE *in = fopen(argv[1], "rb");
+	if (!in) {
+		perror(argv[1]);
+		return 1;
+	}
+	StatsLogHeader h;
+	if (fread(&h, sizeof(h), 1, in) != 1 || memcmp(h.magic, STATSLOG_MAGIC, sizeof(h.magic)) != 0) {
+		fprintf(stderr, "%s: not a packet stats log\n", argv[1]);
+		return 1;
+	}
+	if (h.byte_order != STATSLOG_BYTE_ORDER) {
+		fprintf(stderr, "%s: written on a machine of the other byte order\n", argv[1]);
+		return 1;
+	}
+	if (h.record_size != sizeof(StatsRecord) || h.nb_streams > STATSLOG_MAX_STREAMS) {
+		fprintf(stderr, "%s: unsupported record layout\n", argv[1]);
+		return 1;
+	}
+	FILE *out = argc > 2 ? fopen(argv[2], "w") : stdout;
+	if (!out) {
+		perror(argv[2]);
+		return 1;
+	}
+	fprintf(out, "stream,pts,pts_time,dts,dts_time,size,key,encode_us\n");
+	static const int32_t no_tb[2] = { 0, 0 };
+	StatsRecord rec[1024];
+	size_t n;
+	while ((n = fread(rec, sizeof(StatsRecord), 1024, in)) > 0) {
+		for (size_t i = 0; i < n; i++) {
+			const StatsRecord *r = &rec[i];
+			const int32_t *tb = r->stream < h.nb_streams ? h.time_base[r->stream] : no_tb;
+			fprintf(out, "%u", r->stream);
+			print_ts(out, r->pts, tb);
+			print_ts(out, r->dts, tb);
+			fprintf(out, ",%d,%d,%.3f\n", r->size, (r->flags & STATSLOG_KEY) ? 1 : 0, r->encode_ns / 1e3);
+		}
+	}
+	fclose(in);
+	if (out != stdout && fclose(out) != 0) {
+		perror(argv[2]);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,13 @@
+
+TARGET = stats2csv
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= qt app_bundle
+
+DESTDIR = $$PWD/_bin
+
+SOURCES += \
+	stats2csv.cpp
+
+HEADERS += \
+	statslog.h
@@ -0,0 +1,92 @@
+#include "statslog.h"
+#include "ringbuffer.h"
+#include <atomic>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+
+#define STATSLOG_BLOCK_RECORDS 2048 /* 64 KiB */
+#define STATSLOG_BLOCKS        8
+
+struct StatsBlock {
+	int n;
+	StatsRecord rec[STATSLOG_BLOCK_RECORDS];
+};
+
+struct StatsLog : CacheAligned {
+	SpscRing<StatsBlock *, STATSLOG_BLOCKS> free_ring, ready_ring;
+	StatsBlock *blocks[STATSLOG_BLOCKS] = {};
+	StatsBlock *cur = nullptr; /* being filled by the appender */
+	FILE *fp = nullptr;
+	std::thread thread;
+	std::atomic<int> error{0};
+};
+
+static void write_blocks(StatsLog *l)
+{
+	StatsBlock *b;
+	while (l->ready_ring.pop(&b)) {
+		if (!l->error && fwrite(b->rec, sizeof(StatsRecord), b->n, l->fp) != (size_t)b->n) {
+			l->error = errno ? errno : EIO;
+		}
+		b->n = 0;
+		l->free_ring.push(b);
+	}
+}
+
+int statslog_open(StatsLog **pl, const char *path, int nb_streams, const int32_t (*time_base)[2])
+{
+	StatsLog *l = *pl = new StatsLog;
+	StatsLogHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, STATSLOG_MAGIC, sizeof(h.magic));
+	h.byte_order = STATSLOG_BYTE_ORDER;
+	h.record_size = sizeof(StatsRecord);
+	h.nb_streams = nb_streams < STATSLOG_MAX_STREAMS ? nb_streams : STATSLOG_MAX_STREAMS;
+	for (uint32_t i = 0; i < h.nb_streams; i++) {
+		h.time_base[i][0] = time_base[i][0];
+		h.time_base[i][1] = time_base[i][1];
+	}
+	for (int i = 0; i < STATSLOG_BLOCKS; i++) {
+		l->blocks[i] = new (std::nothrow) StatsBlock;
+		if (!l->blocks[i]) return -ENOMEM;
+		l->blocks[i]->n = 0;
+		l->free_ring.push(l->blocks[i]);
+	}
+	l->fp = fopen(path, "wb");
+	if (!l->fp) return -errno;
+	if (fwrite(&h, sizeof(h), 1, l->fp) != 1) return -(errno ? errno : EIO);
+	l->thread = std::thread(write_blocks, l);
+	return 0;
+}
+
+void statslog_add(StatsLog *l, const StatsRecord *r)
+{
+	/* waits only if the writer is a whole ring of blocks behind */
+	if (!l->cur && !l->free_ring.pop(&l->cur)) return;
+	l->cur->rec[l->cur->n++] = *r;
+	if (l->cur->n == STATSLOG_BLOCK_RECORDS) {
+		l->ready_ring.push(l->cur);
+		l->cur = nullptr;
+	}
+}
+
+int statslog_close(StatsLog **pl)
+{
+	StatsLog *l = *pl;
+	if (!l) return 0;
+	if (l->thread.joinable()) {
+		if (l->cur && l->cur->n) l->ready_ring.push(l->cur);
+		l->ready_ring.close();
+		l->thread.join();
+	}
+	int ret = -l->error;
+	if (l->fp && fclose(l->fp) != 0 && !ret) ret = -errno;
+	for (int i = 0; i < STATSLOG_BLOCKS; i++) {
+		delete l->blocks[i];
+	}
+	delete l;
+	*pl = nullptr;
+	return ret;
+}
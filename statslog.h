@@ -0,0 +1,44 @@
+#ifndef STATSLOG_H
+#define STATSLOG_H
+
+#include <stdint.h>
+
+/* Binary per-packet log (-stats), written next to the output as
+ * <output>.stats and turned into CSV by stats2csv. A StatsLogHeader is
+ * followed by one StatsRecord per packet, both in the byte order of the
+ * machine that wrote them. */
+#define STATSLOG_MAGIC       "PKTSTAT1"
+#define STATSLOG_BYTE_ORDER  0x01020304
+#define STATSLOG_MAX_STREAMS 4
+#define STATSLOG_KEY         0x01 /* StatsRecord.flags */
+
+struct StatsLogHeader {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t record_size;
+	uint32_t nb_streams;
+	int32_t time_base[STATSLOG_MAX_STREAMS][2]; /* num, den of each stream */
+	uint32_t reserved[3];
+};
+struct StatsRecord {
+	int64_t pts, dts; /* stream time base, INT64_MIN when unset */
+	int32_t size;
+	uint32_t encode_ns; /* time spent in the encoder since the previous packet of the stream */
+	uint8_t stream;
+	uint8_t flags;
+	uint8_t reserved[6];
+};
+static_assert(sizeof(StatsLogHeader) == 64, "StatsLogHeader layout");
+static_assert(sizeof(StatsRecord) == 32, "StatsRecord layout");
+
+struct StatsLog;
+
+/* Create 'path' and start the writer thread. Returns 0 or a negative errno. */
+int statslog_open(StatsLog **pl, const char *path, int nb_streams, const int32_t (*time_base)[2]);
+/* Append a record; from one thread at a time. Only copies into a memory
+ * block, full blocks are written out by the writer thread. */
+void statslog_add(StatsLog *l, const StatsRecord *r);
+/* Write what is left and close. Returns 0 or a negative errno. */
+int statslog_close(StatsLog **pl);
+
+#endif